@@ -1,99 +1,19 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
-#include <vector>
+#include <set>
 #include <string>
-#include <fstream>
-#include <sys/stat.h>
-#include <cmath>
-
-#include <optional>
-#include <regex>
-#include <chrono>
+#include <vector>
 
-#include <getopt.h>
-#include <inttypes.h>
-#include <sys/mount.h>
-#include <sys/statvfs.h>
-#include <sys/types.h>
-#include <sysexits.h>
-#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 
-#include <android-base/file.h>
-#include <android-base/parseint.h>
 #include <android-base/properties.h>
-#include <android-base/strings.h>
-#include <cutils/android_get_control_file.h>
-#include <fs_mgr.h>
-#include <liblp/builder.h>
-#include <liblp/liblp.h>
-#include <fs_mgr_dm_linear.h>
-#include <libdm/dm.h>
-#ifndef LPTOOLS_STATIC
-#include <android/hardware/boot/1.1/IBootControl.h>
-#include <android/hardware/boot/1.1/types.h>
-#endif
-
-using namespace android;
-using namespace android::fs_mgr;
-using namespace std;
-using namespace std::literals;
 
+#include "lptools.h"
 
-bool UpdateAllPartitionMetadata(const string& super_name,
-                                const android::fs_mgr::LpMetadata& metadata,
-                                const uint32_t user_slot) {
-    bool ok = true;
-    ok &= UpdatePartitionTable(super_name, metadata, user_slot);
-    return ok;
-}
-
-class PartitionBuilder {
-public:
-    explicit PartitionBuilder(string user_suffix, bool user_slot, string user_super);
-    
-    bool Write();
-    bool Valid() const { return !!builder_; }
-    MetadataBuilder* operator->() const { return builder_.get(); }
-
-private:
-    string super_device_;
-    string slot_suffix_;
-    uint32_t slot_number_;
-    std::unique_ptr<MetadataBuilder> builder_;
-};
-
-PartitionBuilder::PartitionBuilder(string user_suffix, bool user_slot, string user_super) {
-    slot_number_ = user_slot;
-    slot_suffix_ = user_suffix;
-    auto super_device = std::move(user_super);
-    super_device_ = std::move(super_device);
-    builder_ = MetadataBuilder::New(super_device_, slot_number_);
-}
-bool saveToDisk(PartitionBuilder builder) {
-    return builder.Write();
-}
-bool PartitionBuilder::Write() {
-    auto metadata = builder_->Export();
-    if (!metadata) {
-        return false;
-    }
-    return UpdateAllPartitionMetadata(super_device_, *metadata.get(), slot_number_);
-}
-
-
-bool fileOrBlockDeviceExists(const string& path) {
-    std::ifstream file(path);
-    return file.good();
-}
-bool isDirectory(const string& path) {
-    struct stat path_stat;
-    stat(path.c_str(), &path_stat);
-    return S_ISDIR(path_stat.st_mode);
-}
-inline bool ends_with(string const & value, string const & ending)
-{
-    if (ending.size() > value.size()) return false;
-    return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
-}
+using namespace std;
 
 void Help_menu() {
     std::cout << "Basic configuration:\n\n";
@@ -102,30 +22,154 @@ void Help_menu() {
     std::cout << "  --slot <0|1>\n";
     std::cout << "      Slot 0 will be used by default\n";
     std::cout << "  --super </path/to/super>\n";
-    std::cout << "      By default, the standard path /dev/block/by-name/super will be used\n\n";
+    std::cout << "      By default, the standard path /dev/block/by-name/super will be used\n";
+    std::cout << "      Sparse images work for commands that only change the tables\n\n";
     std::cout << "  --group <group_name_in_super>\n";
     std::cout << "      By default, the relative section of system + --suffix in the specified --slot will be searched\n\n";
+    std::cout << "  --all-slots\n";
+    std::cout << "      Write changes to every metadata slot, not only --slot\n\n";
+    std::cout << "  --trace[=<file>]\n";
+    std::cout << "      Time every phase; writes Chrome trace JSON to <file>, or prints a summary\n\n";
+    std::cout << "  --max-rate <MB/s>\n";
+    std::cout << "      Limit the bytes read and written by flash, dump, hash, clone, sync, defrag and make-super\n";
+    std::cout << "  --ionice <idle|best-effort[:0-7]|realtime[:0-7]>\n";
+    std::cout << "      I/O priority for the command and its worker threads\n";
+    std::cout << "  --io-latency <ms>\n";
+    std::cout << "      Halve the rate whenever a write takes longer, and recover slowly once writes are fast again\n\n";
     std::cout << "Please use one of the following options:\n";
-    std::cout << "  --create <partition name> <partition size>\n";
-    std::cout << "  --remove <partition name>\n";
-    std::cout << "  --resize <partition name> <newsize>\n";
+    std::cout << "  --create <partition name> <partition size> [--alloc=<policy>]\n";
+    std::cout << "  --remove <partition name> [--discard]\n";
+    std::cout << "  --resize <partition name> <newsize> [--discard] [--alloc=<policy>]\n";
+    std::cout << "      <policy> is best-fit, contiguous (never split the partition) or end\n";
     std::cout << "  --replace <original partition name> <new partition name>\n";
-    std::cout << "  --map <partition name>\n";
-    std::cout << "  --unmap <partition name>\n";
-    std::cout << "  --free\n";
+    std::cout << "  --swap <partition a> <partition b> [<partition c> <partition d>...]\n";
+    std::cout << "  --rename <old name> <new name> [<old name> <new name>...]\n";
+    std::cout << "  --clone <source partition> <new partition> [--verify-copy]\n";
+    std::cout << "  --sync-slot <_a|_b> <_a|_b> [--dry-run]\n";
+    std::cout << "      Create or resize every partition of the target slot and copy only the blocks that differ\n";
+    std::cout << "  --map <partition name> [partition name...]\n";
+    std::cout << "  --unmap <partition name> [partition name...]\n";
+    std::cout << "  --map-all\n";
+    std::cout << "  --unmap-all\n";
+    std::cout << "  --free [--json] [--extents]\n";
     std::cout << "  --unlimited-group\n";
-    std::cout << "  --clear-cow\n";
-    std::cout << "  --get-info\n\n";
-    exit(1);
+    std::cout << "  --clear-cow [--discard]\n";
+    std::cout << "  --shrink-to-fit <partition name> [partition name...] | --all [--dry-run] [--discard]\n";
+    std::cout << "      Shrink ext4/erofs partitions to their filesystem size with one metadata write\n";
+    std::cout << "  --wipe <partition name>\n";
+    std::cout << "  --get-info [--json]\n";
+    std::cout << "  --backup-metadata <file>\n";
+    std::cout << "  --restore-metadata <file> [--dry-run]\n";
+    std::cout << "      Save the tables of every slot, and write them back without touching partition data\n";
+    std::cout << "  --flash <partition name> <raw or sparse image> [--auto-resize]\n";
+    std::cout << "  --dump <partition name> <output file> [--sparse]\n";
+    std::cout << "  --hash <partition name> [--chunks]\n";
+    std::cout << "      SHA-256 over 4 MiB chunks in parallel; --chunks lists them in the format --verify reads\n";
+    std::cout << "  --verify <partition name> <raw image or hash file>\n";
+    std::cout << "  --make-super <manifest> <output image> [--sparse]\n";
+    std::cout << "      Build a complete super image from a layout manifest; --super is not used\n";
+    std::cout << "  --defrag [group name] [--dry-run] [--journal <file>]\n";
+    std::cout << "      Make every partition of super (or of one group) a single contiguous extent\n";
+    std::cout << "  --batch <file|->\n";
+    std::cout << "      Apply create/remove/resize/map/unmap/unlimited-group/group lines with one metadata write\n";
+    std::cout << "  --daemon [--socket <path>]\n";
+    std::cout << "      Serve commands as line-delimited JSON on a Unix socket (default /dev/socket/lptools)\n";
+    std::cout << "  --client [--socket <path>] <command...>\n";
+    std::cout << "      Run one command through a running --daemon\n\n";
 }
 
-int main(int argc, char* argv[]) {
-    std::vector<string> arguments(argv + 1, argv + argc);
+// Accepts the spellings of --suffix: _a, a or 0 and _b, b or 1.
+static bool parseSlotSuffix(const string& value, string* suffix) {
+    if (value == "_a" || value == "a" || value == "0") {
+        *suffix = "_a";
+    } else if (value == "_b" || value == "b" || value == "1") {
+        *suffix = "_b";
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Parses the size argument of --create and --resize, printing why it was rejected.
+// Goes through parseSize like the daemon's batched requests, so both accept the same
+// spellings.
+static bool parseSizeArgument(const string& value, uint64_t* size) {
+    if (!value.empty() && value[0] == '-') {
+        std::cout << "The size of the section should be larger or equal to zero." << std::endl;
+        return false;
+    }
+    if (!parseSize(value, size)) {
+        std::cerr << "Error: Invalid or out-of-range number." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Parses and runs one command line. |cached| is the daemon's copy of the tables; it is
+// used instead of reading them again when the command works on the same super and slot.
+static int runCommand(std::vector<string> arguments, const MetadataIndex* cached) {
+    if (!arguments.empty() && arguments[0] == "--client") {
+        string socketPath = kDefaultDaemonSocket;
+        arguments.erase(arguments.begin());
+        if (arguments.size() >= 2 && arguments[0] == "--socket") {
+            socketPath = arguments[1];
+            arguments.erase(arguments.begin(), arguments.begin() + 2);
+        }
+        if (arguments.empty()) {
+            std::cout << "--client [--socket <path>] <command...>" << std::endl;
+            return 1;
+        }
+        return runClient(socketPath, arguments);
+    }
+
+    // A sparse --super is swapped for a memfd holding its metadata area, and the tables
+    // are written back into the image once the command succeeded. Commands that touch
+    // partition data or dm devices need the expanded image.
+    auto superArgument = std::find(arguments.begin(), arguments.end(), "--super");
+    if (superArgument != arguments.end() && superArgument + 1 != arguments.end() &&
+        isSparseImage(superArgument[1])) {
+        static const std::set<string> kDataOptions = {"--flash", "--dump", "--hash", "--verify", "--map", "--unmap",
+                                                      "--map-all", "--unmap-all", "--clone", "--sync-slot",
+                                                      "--defrag", "--wipe", "--shrink-to-fit", "--daemon",
+                                                      "--make-super", "--discard"};
+        for (const auto& arg : arguments) {
+            if (kDataOptions.count(arg)) {
+                std::cerr << "Error: " << arg << " does not work on a sparse super image, expand it with simg2img first."
+                          << std::endl;
+                return 1;
+            }
+        }
+        SparseSuperImage image;
+        if (!image.Open(superArgument[1])) {
+            return 1;
+        }
+        superArgument[1] = image.path();
+        int status = runCommand(arguments, nullptr);
+        if (status == 0 && !image.Commit()) {
+            status = 1;
+        }
+        return status;
+    }
 
     int slotValue = 0;
     std::string suffixValue = ::android::base::GetProperty("ro.boot.slot_suffix", "");
     std::string superPath = "/dev/block/by-name/super";
     std::string groupValue;
+    bool autoResize = false;
+    bool sparseOutput = false;
+    bool dryRun = false;
+    bool jsonOutput = false;
+    std::string journalPath;
+    bool trace = false;
+    bool verifyCopy = false;
+    bool discard = false;
+    bool listChunks = false;
+    bool listExtents = false;
+    bool allSlots = false;
+    AllocPolicy allocPolicy = AllocPolicy::kDefault;
+    std::string tracePath;
+    IoLimits ioLimits;
+    std::string socketPath = kDefaultDaemonSocket;
     
     for (size_t i = 0; i < arguments.size();) {
         if (arguments[i] == "--slot") {
@@ -144,12 +188,7 @@ int main(int argc, char* argv[]) {
             }
         } else if (arguments[i] == "--suffix") {
             if (i + 1 < arguments.size()) {
-                string suffixCandidate = arguments[i + 1];
-                if (suffixCandidate == "_a" || suffixCandidate == "a" || suffixCandidate == "0") {
-                    suffixValue = "_a";
-                } else if (suffixCandidate == "_b" || suffixCandidate == "b" || suffixCandidate == "1") {
-                    suffixValue = "_b";
-                } else {
+                if (!parseSlotSuffix(arguments[i + 1], &suffixValue)) {
                     std::cerr << "Error: Invalid value for --suffix. Should be '_a', 'a', '0', '_b', 'b', or '1'." << std::endl;
                     return 1;
                 }
@@ -173,6 +212,79 @@ int main(int argc, char* argv[]) {
                 std::cerr << "Error: --group requires a value." << std::endl;
                 return 1;
             }
+        } else if (arguments[i] == "--auto-resize") {
+            autoResize = true;
+            arguments.erase(arguments.begin() + i);
+        } else if (arguments[i] == "--sparse") {
+            sparseOutput = true;
+            arguments.erase(arguments.begin() + i);
+        } else if (arguments[i] == "--json") {
+            jsonOutput = true;
+            arguments.erase(arguments.begin() + i);
+        } else if (arguments[i] == "--discard") {
+            discard = true;
+            arguments.erase(arguments.begin() + i);
+        } else if (arguments[i] == "--extents") {
+            listExtents = true;
+            arguments.erase(arguments.begin() + i);
+        } else if (arguments[i].compare(0, 8, "--alloc=") == 0) {
+            if (!parseAllocPolicy(arguments[i].substr(8), &allocPolicy)) {
+                std::cerr << "Error: Invalid value for --alloc. Should be 'best-fit', 'contiguous' or 'end'." << std::endl;
+                return 1;
+            }
+            arguments.erase(arguments.begin() + i);
+        } else if (arguments[i] == "--socket") {
+            if (i + 1 < arguments.size()) {
+                socketPath = arguments[i + 1];
+                arguments.erase(arguments.begin() + i, arguments.begin() + i + 2);
+            } else {
+                std::cerr << "Error: --socket requires a value." << std::endl;
+                return 1;
+            }
+        } else if (arguments[i] == "--chunks") {
+            listChunks = true;
+            arguments.erase(arguments.begin() + i);
+        } else if (arguments[i] == "--verify-copy") {
+            verifyCopy = true;
+            arguments.erase(arguments.begin() + i);
+        } else if (arguments[i] == "--all-slots") {
+            allSlots = true;
+            arguments.erase(arguments.begin() + i);
+        } else if (arguments[i] == "--dry-run") {
+            dryRun = true;
+            arguments.erase(arguments.begin() + i);
+        } else if (arguments[i] == "--journal") {
+            if (i + 1 < arguments.size()) {
+                journalPath = arguments[i + 1];
+                arguments.erase(arguments.begin() + i, arguments.begin() + i + 2);
+            } else {
+                std::cerr << "Error: --journal requires a value." << std::endl;
+                return 1;
+            }
+        } else if (arguments[i] == "--max-rate" || arguments[i] == "--ionice" || arguments[i] == "--io-latency") {
+            if (i + 1 >= arguments.size()) {
+                std::cerr << "Error: " << arguments[i] << " requires a value." << std::endl;
+                return 1;
+            }
+            const string& value = arguments[i + 1];
+            char* end;
+            double number = strtod(value.c_str(), &end);
+            bool valid = arguments[i] == "--ionice" ? parseIoniceClass(value, &ioLimits)
+                                                    : !value.empty() && *end == '\0' && number > 0;
+            if (!valid) {
+                std::cerr << "Error: Invalid value for " << arguments[i] << ": " << value << std::endl;
+                return 1;
+            }
+            if (arguments[i] == "--max-rate") {
+                ioLimits.maxRate = number * 1024 * 1024;
+            } else if (arguments[i] == "--io-latency") {
+                ioLimits.latencyTarget = std::chrono::milliseconds(static_cast<int64_t>(std::ceil(number)));
+            }
+            arguments.erase(arguments.begin() + i, arguments.begin() + i + 2);
+        } else if (arguments[i] == "--trace" || arguments[i].compare(0, 8, "--trace=") == 0) {
+            trace = true;
+            tracePath = arguments[i].size() > 8 ? arguments[i].substr(8) : "";
+            arguments.erase(arguments.begin() + i);
         } else if (arguments[i] == "--super") {
             if (i + 1 < arguments.size()) {
                 superPath = arguments[i + 1];
@@ -192,38 +304,96 @@ int main(int argc, char* argv[]) {
             ++i;
         }
     }
-    if (!fileOrBlockDeviceExists(superPath)) {
+    // Set on every call so a daemon request does not inherit --all-slots from an
+    // earlier one.
+    setCommitAllSlots(allSlots);
+    // --make-super creates an image instead of working on --super.
+    bool makeSuperCommand = !arguments.empty() && arguments[0] == "--make-super";
+    if (!makeSuperCommand && !fileOrBlockDeviceExists(superPath)) {
         std::cerr << "Super section along the standard path" << superPath << " not found, indicate the independent path -SUPER </path/to/super>" << std::endl;
         return 1;
     }
     if (arguments.size() < 1) {
         Help_menu();
-        exit(1);
+        return 1;
     }
-    PartitionBuilder builder(suffixValue, slotValue, superPath);
-    if (groupValue.empty()) {
-        auto groups = builder->ListGroups();
-        auto partitionName = "system" + suffixValue;
-        for (auto groupName : groups) {
-            auto partitions = builder->ListPartitionsInGroup(groupName);
-            for (const auto& partition : partitions) {
-                if (partition->name() == partitionName) {
-                    groupValue = groupName;
-                    goto outerLoopEnd;
-                }
+    if (arguments[0] == "--daemon") {
+        if (arguments.size() != 1) {
+            std::cout << "--daemon [--socket <path>]" << std::endl;
+            return 1;
+        }
+        DaemonOptions options;
+        options.socketPath = socketPath;
+        options.superPath = superPath;
+        options.slot = slotValue;
+        options.suffix = suffixValue;
+        options.allSlots = allSlots;
+        // Requests default to the daemon's super, slot and suffix.
+        return runDaemon(options, [&](const std::vector<string>& request, const MetadataIndex* index) {
+            std::vector<string> args = {"--super", superPath, "--slot", std::to_string(slotValue)};
+            if (!suffixValue.empty()) {
+                args.insert(args.end(), {"--suffix", suffixValue});
             }
+            args.insert(args.end(), request.begin(), request.end());
+            return runCommand(std::move(args), index);
+        });
+    }
+    // dm devices only ever point at a block device. On an image file a device of the
+    // same name belongs to another super, so it is neither created nor touched.
+    static const std::set<string> kDmCommands = {"--map", "--unmap", "--map-all", "--unmap-all"};
+    if (kDmCommands.count(arguments[0]) && !isBlockDevice(superPath)) {
+        std::cerr << "Error: " << superPath << " is not a block device, partitions cannot be mapped" << std::endl;
+        return 1;
+    }
+    TraceSession traceSession(trace, tracePath);
+    IoSession ioSession(ioLimits);
+    // Commands that only read the layout work from the on-disk tables, and --unmap, a
+    // single --map or --make-super never need them at all (CreateLogicalPartition reads
+    // its own copy). The metadata backup commands read every slot themselves, and a
+    // restore has to work even when the current slot is corrupt.
+    static const std::set<string> kReadOnlyCommands = {"--map", "--unmap", "--map-all", "--unmap-all",
+                                                       "--free", "--get-info", "--dump", "--wipe",
+                                                       "--hash", "--verify", "--make-super",
+                                                       "--backup-metadata", "--restore-metadata"};
+    const string& command = arguments[0];
+    bool needsMetadata = !(command == "--unmap" || (command == "--map" && arguments.size() == 2) || makeSuperCommand ||
+                           command == "--backup-metadata" || command == "--restore-metadata");
+    MetadataIndex loaded;
+    bool useCached = cached != nullptr && cached->IsFrom(superPath, slotValue);
+    if (needsMetadata && !useCached && !loaded.Load(superPath, slotValue)) {
+        std::cerr << "Error: Unable to read metadata from " << superPath << std::endl;
+        return 1;
+    }
+    const MetadataIndex& index = useCached ? *cached : loaded;
+    PartitionBuilder builder;
+    if (!kReadOnlyCommands.count(command)) {
+        builder = PartitionBuilder(index.metadata(), slotValue, superPath);
+        if (!builder.Valid()) {
+            std::cerr << "Error: Unable to load metadata from " << superPath << std::endl;
+            return 1;
         }
-    } else {
-        auto groups = builder->ListGroups();
-        
-        // Проверка существования groupValue в списке groups
-        if (std::find(groups.begin(), groups.end(), groupValue) == groups.end()) {
+    }
+    {
+        TraceScope groupTrace("GroupLookup");
+        if (!needsMetadata) {
+            // Nothing to look the group up in.
+        } else if (groupValue.empty()) {
+            groupValue = detectGroup(index, suffixValue);
+        } else if (index.FindGroup(groupValue) == nullptr) {
             std::cerr << "Error: Specified group '" << groupValue << "' does not exist." << std::endl;
             return 1;
         }
     }
 
-    outerLoopEnd:
+
+    if (jsonOutput) {
+        if (command != "--free" && command != "--get-info") {
+            std::cerr << "Error: --json is only supported by --free and --get-info." << std::endl;
+            return 1;
+        }
+        printJsonInfo(index, command == "--free" ? groupValue : "", slotValue, suffixValue, superPath, groupValue);
+        return 0;
+    }
 
     std::cout << "Slot: " << slotValue << std::endl;
     std::cout << "Suffix: " << suffixValue << std::endl;
@@ -236,318 +406,198 @@ int main(int argc, char* argv[]) {
     }
     std::cout << std::endl;
 
+    TraceScope commandTrace("Command", command);
     if (arguments[0] == "--create" ) {
         if (arguments.size() != 3) {
             std::cout << "--create <partition name> <partition size>" << std::endl;
             return 1;
         }
-        char* end;
-        auto partitionSize = strtoll(arguments[2].c_str(), &end, 0);
-
-        // Проверяем, были ли ошибки при преобразовании.
-        if (errno == ERANGE || *end != '\0') {
-            std::cerr << "Error: Invalid or out-of-range number." << std::endl;
+        uint64_t partitionSize;
+        if (!parseSizeArgument(arguments[2], &partitionSize)) {
             return 1;
         }
-
-        // Проверяем, что это число больше или равно нулю.
-        if (partitionSize >= 0) {
-
-            
-            std::cout << "Create functions " << partitionSize << std::endl;
-            string partName = arguments[1]; 
-            cout << groupValue << endl;
-            auto partition = builder->FindPartition(partName);
-            if(partition != nullptr) {
-                std::cerr << "Partition " << partName << " already exists." << std::endl;
-                exit(1);
-            }
-
-            partition = builder->AddPartition(partName, groupValue, 0);
-            cout << partition << endl;
-            if(partition == nullptr) {
-                std::cerr << "Failed to add partition" << std::endl;
-                exit(1);
-            }
-            auto result = builder->ResizePartition(partition, partitionSize);
-            std::cout << "Growing partition " << result << std::endl;
-            if(!result) {
-                std::cerr << "Not enough space to resize partition" << std::endl;
-                exit(1);
-            }
-            if(!saveToDisk(std::move(builder))) {
-                std::cerr << "Failed to write partition table" << std::endl;
-                exit(1);
-            }
-            string dmPath;
-            CreateLogicalPartitionParams params {
-                    .block_device = superPath,
-                    .metadata_slot = slotValue,
-                    .partition_name = partName,
-                    .timeout_ms = std::chrono::milliseconds(10000),
-                    .force_writable = true,
-            };
-            auto dmCreateRes = android::fs_mgr::CreateLogicalPartition(params, &dmPath);
-            if(!dmCreateRes) {
-                std::cerr << "Could not map partition: " << partName << std::endl;
-                exit(1);
-            }    
-            std::cout << "Creating dm partition for " << partName << " answered " << dmCreateRes << " at " << dmPath << std::endl;
-            return 0;
-        } else {
-            std::cout << "The size of the section should be larger or equal to zero." << std::endl;
-            exit(1);
-        }
+        return createPartition(builder, superPath, slotValue, groupValue, arguments[1], partitionSize, allocPolicy);
     } else if (arguments[0] == "--remove" ) {
         if (arguments.size() != 2) {
             std::cout << "--remove <partition name>" << std::endl;
-            exit(1);
-        }
-        string partName = arguments[1];
-        auto dmState = android::dm::DeviceMapper::Instance().GetState(partName);
-        if(dmState == android::dm::DmDeviceState::ACTIVE) {
-            android::fs_mgr::DestroyLogicalPartition(partName);
-        }
-        builder->RemovePartition(partName);
-        if(!saveToDisk(std::move(builder))) {
-            std::cerr << "Failed to write partition table" << std::endl;
-            exit(1);
+            return 1;
         }
-        cout << "Successful removal of the section: " << partName << endl;
-        exit(0);
+        return removePartition(builder, superPath, arguments[1], discard);
     } else if (arguments[0] == "--resize" ) {
         if (arguments.size() != 3) {
             std::cout << "--resize <partition name> <newsize>" << std::endl;
-            exit(1);
-        }
-        string partName = arguments[1];
-        char* end;
-        auto partitionSize = strtoll(arguments[2].c_str(), &end, 0);
-
-        // Проверяем, были ли ошибки при преобразовании.
-        if (errno == ERANGE || *end != '\0') {
-            std::cerr << "Error: Invalid or out-of-range number." << std::endl;
             return 1;
         }
-        if (partitionSize >= 0) {
-            bool is_map_need = false;
-            auto partition = builder->FindPartition(partName);
-            if(partition == nullptr) {
-                std::cerr << "Partition does not exist" << std::endl;
-                exit(1);
-            }
-            auto dmState = android::dm::DeviceMapper::Instance().GetState(partName);
-            if(dmState == android::dm::DmDeviceState::ACTIVE) {
-                if (android::fs_mgr::DestroyLogicalPartition(partName)) {
-                    is_map_need = true;
-                }
-                
-            }
-            auto result = builder->ResizePartition(partition, partitionSize);
-            if(!result) {
-                std::cerr << "Not enough space to resize partition" << std::endl;
-                exit(1);
-            }
-            if(!saveToDisk(std::move(builder))) {
-                std::cerr << "Failed to write partition table" << std::endl;
-                exit(1);
-            }
-            std::cout << "Resizing partition " << result << std::endl;
-            if (is_map_need) {
-                string dmPath;
-                CreateLogicalPartitionParams params {
-                        .block_device = superPath,
-                        .metadata_slot = slotValue,
-                        .partition_name = partName,
-                        .timeout_ms = std::chrono::milliseconds(10000),
-                        .force_writable = true,
-                };
-                auto dmCreateRes = android::fs_mgr::CreateLogicalPartition(params, &dmPath);
-                if(!dmCreateRes) {
-                    std::cerr << "Could not map partition: " << partName << std::endl;
-                    exit(1);
-                }
-                std::cout << "Creating dm partition for " << partName << " answered " << dmCreateRes << " at " << dmPath << std::endl;
-            }
-            cout << "Successful change in section for the section:" << partName << endl;
-            exit(0);
-        } else {
-            std::cout << "The size of the section should be larger or equal to zero." << std::endl;
-            exit(1);
+        uint64_t partitionSize;
+        if (!parseSizeArgument(arguments[2], &partitionSize)) {
+            return 1;
         }
+        return resizePartition(builder, superPath, slotValue, arguments[1], partitionSize, discard, allocPolicy);
     } else if (arguments[0] == "--replace" ) {
         if (arguments.size() != 3) {
             std::cout << "--replace <original partition name> <new partition name>" << std::endl;
-            exit(1);
-        }
-        auto OriginalPartName = arguments[1];
-        auto NewPartName = arguments[2];
-        auto OriginalPartition = builder->FindPartition(OriginalPartName);
-        if(OriginalPartition == nullptr) {
-            std::cerr << "The original section was not found, maybe you meant " << OriginalPartName << suffixValue << "?" << std::endl;
-            exit(1);
-        }
-        auto NewPartition = builder->FindPartition(NewPartName);
-        std::vector<std::unique_ptr<Extent>> originalExtents;
-        const auto& extents = OriginalPartition->extents();
-        for(unsigned i=0; i<extents.size(); i++) {
-            const auto& extend = extents[i];
-            auto linear = extend->AsLinearExtent();
-            if(linear != nullptr) {
-                auto copyLinear = std::make_unique<LinearExtent>(linear->num_sectors(), linear->device_index(), linear->physical_sector());
-                originalExtents.push_back(std::move(copyLinear));
-            } else {
-                auto copyZero = std::make_unique<ZeroExtent>(extend->num_sectors());
-                originalExtents.push_back(std::move(copyZero));
-            }
-            builder->RemovePartition(OriginalPartName);
-            builder->RemovePartition(NewPartName);
-            auto NewPartition = builder->AddPartition(NewPartName, groupValue, 0);
-            if(NewPartition == nullptr) {
-                std::cerr << "Failed to add partition" << std::endl;
-                exit(1);
-            }
-            for(auto&& extent: originalExtents) {
-                NewPartition->AddExtent(std::move(extent));
-            }
-            if(!saveToDisk(std::move(builder))) {
-                std::cerr << "Failed to write partition table" << std::endl;
-                exit(1);
-            }
+            return 1;
         }
-
+        return replacePartition(builder, groupValue, suffixValue, arguments[1], arguments[2]);
+    } else if ((arguments[0] == "--map" && arguments.size() > 2) || arguments[0] == "--map-all") {
+        if (arguments[0] == "--map-all" && arguments.size() != 1) {
+            std::cout << "--map-all" << std::endl;
+            return 1;
+        }
+        std::vector<string> names(arguments.begin() + 1, arguments.end());
+        return mapPartitionsCommand(index, superPath, names, arguments[0] == "--map-all", groupValue);
+    } else if ((arguments[0] == "--unmap" && arguments.size() > 2) || arguments[0] == "--unmap-all") {
+        if (arguments[0] == "--unmap-all" && arguments.size() != 1) {
+            std::cout << "--unmap-all" << std::endl;
+            return 1;
+        }
+        std::vector<string> names(arguments.begin() + 1, arguments.end());
+        return unmapPartitionsCommand(index, names, arguments[0] == "--unmap-all", groupValue);
     } else if (arguments[0] == "--map" ) {
         if (arguments.size() != 2) {
-            std::cout << "--map <partition name>" << std::endl;
-            exit(1);
-        }
-        string partName = arguments[1];
-        string dmPath;
-        CreateLogicalPartitionParams params {
-                .block_device = superPath,
-                .metadata_slot = slotValue,
-                .partition_name = partName,
-                .timeout_ms = std::chrono::milliseconds(10000),
-                .force_writable = true,
-        };
-        auto dmCreateRes = android::fs_mgr::CreateLogicalPartition(params, &dmPath);
-        if(!dmCreateRes) {
-            std::cerr << "Could not map partition: " << partName << std::endl;
-            exit(1);
-        }
-        std::cout << "Creating dm partition for " << partName << " answered " << dmCreateRes << " at " << dmPath << std::endl;
-        exit(0);
+            std::cout << "--map <partition name> [partition name...]" << std::endl;
+            return 1;
+        }
+        return mapPartitionCommand(superPath, slotValue, arguments[1]);
     } else if (arguments[0] == "--unmap" ) {
         if (arguments.size() != 2) {
-            std::cout << "--unmap <partition name>" << std::endl;
-            exit(1);
-        }
-        string partName = arguments[1];
-        auto dmState = android::dm::DeviceMapper::Instance().GetState(partName);
-        if(dmState == android::dm::DmDeviceState::ACTIVE) {
-            if (!android::fs_mgr::DestroyLogicalPartition(partName)) {
-                std::cerr << "Unable to unmap " << partName << std::endl;
-                exit(1);
-            }
+            std::cout << "--unmap <partition name> [partition name...]" << std::endl;
+            return 1;
         }
-        cout << "Successful remote Mapping DM section: " << partName << endl;
-        exit(0);
+        return unmapPartitionCommand(arguments[1]);
     } else if (arguments[0] == "--free" ) {
         if (arguments.size() != 1) {
-            std::cout << "--free" << std::endl;
-            exit(1);
+            std::cout << "--free [--extents]" << std::endl;
+            return 1;
         }
-
-        auto group_number = builder->FindGroup(groupValue);
-        uint64_t maxSize = group_number->maximum_size();
-        uint64_t total = 0;
-        auto partitions = builder->ListPartitionsInGroup(groupValue);
-        for (const auto& partition : partitions) {
-            cout << "" << endl;
-            float size_mb = std::round((partition->BytesOnDisk() / 1024.0 / 1024.0) * 100) / 100.0;
-            if ( size_mb == 0 ) {
-                size_mb = std::round((partition->BytesOnDisk() / 1024.0) * 100) / 100.0;
-                std::cout << partition->name() << ":" << partition->BytesOnDisk() << ":" << size_mb << "KB" << std::endl;
-            } else {
-                std::cout << partition->name() << ":" << partition->BytesOnDisk() << ":" << size_mb << "MB" << std::endl;
-            }
-            total += partition->BytesOnDisk();
-        }
-        uint64_t groupAllocatable = maxSize - total;
-        cout << "" << endl;
-        // std::cout << builder->AllocatableSpace() << ":" << builder->UsedSpace() << std::endl;
-        uint64_t superFreeSpace = builder->AllocatableSpace() - builder->UsedSpace();
-        if(groupAllocatable > superFreeSpace || maxSize == 0)
-            groupAllocatable = superFreeSpace;
-
-        printf("Free space: %" PRIu64 "\n", groupAllocatable);
-
-        exit(0);
-
+        return listExtents ? printFreeExtents(index) : printFreeSpace(index, groupValue);
     } else if (arguments[0] == "--get-info" ) {
         if (arguments.size() != 1) {
             std::cout << "--get-info" << std::endl;
-            exit(1);
-        }
-        
-        auto groups = builder->ListGroups();
-        for(auto groupName: groups) {
-            auto partitions = builder->ListPartitionsInGroup(groupName);
-            if ( groupName == groupValue ) {
-                cout << "" << endl;
-                cout << "GroupInSuper->" << groupName << " Usage->" << builder->UsedSpace() << " TotalSpace->" << builder->AllocatableSpace() << endl;
-                for (const auto& partition : partitions) {
-                    cout << "NamePartInGroup->" << partition->name() << " Size->" << partition->BytesOnDisk() << endl;
-                }
-            }
-            
+            return 1;
         }
-
+        return printGroupInfo(index, groupValue);
     } else if (arguments[0] == "--unlimited-group" ) {
         if (arguments.size() != 1) {
             std::cout << "--unlimited-group" << std::endl;
-            exit(1);
+            return 1;
         }
-        builder->ChangeGroupSize(groupValue, 0);
-        saveToDisk(std::move(builder));
-        return 0;
-    } else if (arguments[0] == "--clear-cow" ) {
-#ifndef LPTOOLS_STATIC
-        // Ensure this is a V AB device, and that no merging is taking place (merging? in gsi? uh)
-        auto svc1_1 = ::android::hardware::boot::V1_1::IBootControl::tryGetService();
-        if(svc1_1 == nullptr) {
-            std::cerr << "Couldn't get a bootcontrol HAL. You can clear cow only on V AB devices" << std::endl;
+        return setUnlimitedGroup(builder, groupValue);
+    } else if (arguments[0] == "--flash" ) {
+        if (arguments.size() != 3) {
+            std::cout << "--flash <partition name> <raw or sparse image> [--auto-resize]" << std::endl;
             return 1;
         }
-        auto mergeStatus = svc1_1->getSnapshotMergeStatus();
-        if(mergeStatus != ::android::hardware::boot::V1_1::MergeStatus::NONE) {
-            std::cerr << "Merge status is NOT none, meaning a merge is pending. Clearing COW isn't safe" << std::endl;
+        return flashPartition(builder, superPath, slotValue, arguments[1], arguments[2], autoResize);
+    } else if (arguments[0] == "--dump" ) {
+        if (arguments.size() != 3) {
+            std::cout << "--dump <partition name> <output file> [--sparse]" << std::endl;
             return 1;
         }
-#endif
-
-        uint64_t superFreeSpace = builder->AllocatableSpace() - builder->UsedSpace();
-        std::cerr << "Super allocatable " << superFreeSpace << std::endl;
-
-        uint64_t total = 0;
-        auto partitions = builder->ListPartitionsInGroup("cow");
-        for (const auto& partition : partitions) {
-            std::cout << "Deleting partition? " << partition->name() << std::endl;
-            if(ends_with(partition->name(), "-cow")) {
-                std::cout << "Deleting partition " << partition->name() << std::endl;
-                builder->RemovePartition(partition->name());
+        return dumpPartition(index, superPath, arguments[1], arguments[2], sparseOutput);
+    } else if (arguments[0] == "--hash" ) {
+        if (arguments.size() != 2) {
+            std::cout << "--hash <partition name> [--chunks]" << std::endl;
+            return 1;
+        }
+        return hashPartition(index, superPath, arguments[1], listChunks);
+    } else if (arguments[0] == "--verify" ) {
+        if (arguments.size() != 3) {
+            std::cout << "--verify <partition name> <raw image or hash file>" << std::endl;
+            return 1;
+        }
+        return verifyPartition(index, superPath, arguments[1], arguments[2]);
+    } else if (arguments[0] == "--make-super" ) {
+        if (arguments.size() != 3) {
+            std::cout << "--make-super <manifest> <output image> [--sparse]" << std::endl;
+            return 1;
+        }
+        return makeSuper(arguments[1], arguments[2], sparseOutput);
+    } else if (arguments[0] == "--defrag" ) {
+        if (arguments.size() > 2) {
+            std::cout << "--defrag [group name] [--dry-run] [--journal <file>]" << std::endl;
+            return 1;
+        }
+        string scopeGroup = arguments.size() == 2 ? arguments[1] : "";
+        if (!scopeGroup.empty() && builder->FindGroup(scopeGroup) == nullptr) {
+            std::cerr << "Error: Specified group '" << scopeGroup << "' does not exist." << std::endl;
+            return 1;
+        }
+        if (journalPath.empty()) {
+            // The journal has to survive a reboot, so it cannot live in /dev next to a block device.
+            struct stat st;
+            bool isFile = stat(superPath.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+            journalPath = isFile ? superPath + ".defrag-journal" : "/metadata/lptools-defrag.journal";
+        }
+        return defragSuper(builder, superPath, slotValue, scopeGroup, dryRun, journalPath);
+    } else if (arguments[0] == "--swap" || arguments[0] == "--rename" ) {
+        if (arguments.size() < 3 || arguments.size() % 2 == 0) {
+            if (arguments[0] == "--swap") {
+                std::cout << "--swap <partition a> <partition b> [<partition c> <partition d>...]" << std::endl;
+            } else {
+                std::cout << "--rename <old name> <new name> [<old name> <new name>...]" << std::endl;
             }
+            return 1;
+        }
+        std::vector<string> names(arguments.begin() + 1, arguments.end());
+        return swapPartitions(builder, superPath, slotValue, names, arguments[0] == "--rename");
+    } else if (arguments[0] == "--wipe" ) {
+        if (arguments.size() != 2) {
+            std::cout << "--wipe <partition name>" << std::endl;
+            return 1;
         }
-        if(!saveToDisk(std::move(builder))) {
-            std::cerr << "Failed to write partition table" << std::endl;
-            exit(1);
+        return wipePartition(index, superPath, arguments[1]);
+    } else if (arguments[0] == "--clone" ) {
+        if (arguments.size() != 3) {
+            std::cout << "--clone <source partition> <new partition> [--verify-copy]" << std::endl;
+            return 1;
         }
-        return 0;
-
+        return clonePartition(builder, superPath, slotValue, groupValue, arguments[1], arguments[2], verifyCopy);
+    } else if (arguments[0] == "--batch" ) {
+        if (arguments.size() != 2) {
+            std::cout << "--batch <file|->" << std::endl;
+            return 1;
+        }
+        return runBatch(builder, arguments[1], groupValue, superPath, slotValue);
+    } else if (arguments[0] == "--sync-slot" ) {
+        string fromSuffix, toSuffix;
+        if (arguments.size() != 3 || !parseSlotSuffix(arguments[1], &fromSuffix) ||
+            !parseSlotSuffix(arguments[2], &toSuffix)) {
+            std::cout << "--sync-slot <source suffix> <target suffix> [--dry-run]" << std::endl;
+            return 1;
+        }
+        return syncSlot(builder, superPath, slotValue, fromSuffix, toSuffix, dryRun);
+    } else if (arguments[0] == "--backup-metadata" ) {
+        if (arguments.size() != 2) {
+            std::cout << "--backup-metadata <file>" << std::endl;
+            return 1;
+        }
+        return backupMetadata(superPath, arguments[1]);
+    } else if (arguments[0] == "--restore-metadata" ) {
+        if (arguments.size() != 2) {
+            std::cout << "--restore-metadata <file> [--dry-run]" << std::endl;
+            return 1;
+        }
+        return restoreMetadata(superPath, slotValue, arguments[1], dryRun);
+    } else if (arguments[0] == "--clear-cow" ) {
+        return clearCow(builder, superPath, discard);
+    } else if (arguments[0] == "--shrink-to-fit" ) {
+        bool all = arguments.size() == 2 && arguments[1] == "--all";
+        if (arguments.size() < 2 || (!all && std::count(arguments.begin(), arguments.end(), "--all") > 0)) {
+            std::cout << "--shrink-to-fit <partition name> [partition name...] | --all" << std::endl;
+            return 1;
+        }
+        std::vector<string> names;
+        if (!all) names.assign(arguments.begin() + 1, arguments.end());
+        return shrinkToFit(builder, superPath, slotValue, names, all, dryRun, discard);
     } else {
         Help_menu();
-        exit(1);
+        return 1;
     }
 
     return 0;
 }
+
+int main(int argc, char* argv[]) {
+    return runCommand(std::vector<string>(argv + 1, argv + argc), nullptr);
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+#include <liblp/builder.h>
+#include <liblp/liblp.h>
+#include <liblp/partition_opener.h>
+
+// Resolves the metadata device for liblp to --super. The tables name it "super" and
+// liblp looks it up by that name, which would otherwise mean /dev/block/by-name/super.
+// A regular image file has no block device ioctls, so its size comes from stat().
+class SuperPartitionOpener : public android::fs_mgr::PartitionOpener {
+public:
+    explicit SuperPartitionOpener(std::string superPath) : super_path_(std::move(superPath)) {}
+
+    android::base::unique_fd Open(const std::string& partition_name, int flags) const override;
+    bool GetInfo(const std::string& partition_name, android::fs_mgr::BlockDeviceInfo* info) const override;
+    std::string GetDeviceString(const std::string& partition_name) const override;
+
+    // Opens --super without O_SYNC; the caller syncs once after all of its writes.
+    void set_defer_sync(bool defer) { defer_sync_ = defer; }
+
+private:
+    std::string Resolve(const std::string& partition_name) const;
+
+    std::string super_path_;
+    bool defer_sync_ = false;
+};
+
+// An Android sparse image given as --super. Only its metadata area is expanded, into
+// a memfd that commands use in its place; Commit() writes changed tables back without
+// expanding the rest of the image.
+class SparseSuperImage {
+public:
+    bool Open(const std::string& path);
+    const std::string& path() const { return memfd_path_; }
+    bool Commit();
+
+private:
+    std::string image_path_;
+    std::string memfd_path_;
+    android::base::unique_fd memfd_;
+    uint32_t block_size_ = 0;
+    uint64_t head_size_ = 0;
+    std::vector<uint8_t> original_head_;
+};
+
+bool isSparseImage(const std::string& path);
+
+// --trace: wall time, CPU time and bytes read/written per phase. Scopes cost nothing
+// until tracing is enabled. Bytes come from /proc/self/io and count every thread.
+class TraceScope {
+public:
+    explicit TraceScope(const char* name, std::string detail = "");
+    ~TraceScope();
+
+private:
+    const char* name_;
+    std::string detail_;
+    bool active_ = false;
+    int64_t start_us_ = 0;
+    int64_t cpu_start_us_ = 0;
+    uint64_t read_start_ = 0;
+    uint64_t write_start_ = 0;
+};
+
+// Enables tracing for its lifetime when |enabled|. On destruction the phases are written
+// as Chrome trace JSON to |path|, or summarized on stderr when |path| is empty.
+class TraceSession {
+public:
+    TraceSession(bool enabled, std::string path);
+    ~TraceSession();
+
+private:
+    bool enabled_;
+    std::string path_;
+};
+
+// --max-rate, --ionice and --io-latency: how hard the bulk data paths (flash, dump,
+// hash, clone, sync, defrag, make-super) may drive the storage. Their reads and
+// writes share one token bucket of |maxRate| bytes per second. With |latencyTarget|,
+// the rate is halved whenever a write takes longer and recovers after a quiet second.
+struct IoLimits {
+    uint64_t maxRate = 0;
+    int ioprioClass = 0;
+    int ioprioLevel = 0;
+    std::chrono::milliseconds latencyTarget{0};
+};
+// Accepts idle, best-effort[:level] and realtime[:level], or the classes 1-3.
+bool parseIoniceClass(const std::string& value, IoLimits* limits);
+
+// Applies |limits| for its lifetime. On destruction the throughput and the time spent
+// throttled are printed on stderr if a limit was set, and the I/O priority is restored.
+class IoSession {
+public:
+    explicit IoSession(const IoLimits& limits);
+    ~IoSession();
+
+private:
+    long previousIoprio_ = -1;
+};
+
+// --all-slots: commits update every metadata slot instead of only the one being edited.
+void setCommitAllSlots(bool allSlots);
+// Whether |a| and |b| would serialize to the same tables.
+bool metadataEquals(const android::fs_mgr::LpMetadata& a, const android::fs_mgr::LpMetadata& b);
+// Writes |metadata| to |user_slot| (or every slot with --all-slots), skipping slots
+// whose on-disk tables already match.
+bool UpdateAllPartitionMetadata(const std::string& super_name,
+                                const android::fs_mgr::LpMetadata& metadata,
+                                const uint32_t user_slot);
+
+class PartitionBuilder {
+public:
+    PartitionBuilder() = default;
+    explicit PartitionBuilder(std::string user_suffix, bool user_slot, std::string user_super);
+    // Builds from metadata that was already read from |user_super|, avoiding a second parse.
+    PartitionBuilder(const android::fs_mgr::LpMetadata& metadata, uint32_t user_slot, std::string user_super);
+
+    bool Write();
+    bool Valid() const { return !!builder_; }
+    android::fs_mgr::MetadataBuilder* operator->() const { return builder_.get(); }
+
+private:
+    std::string super_device_;
+    std::string slot_suffix_;
+    uint32_t slot_number_ = 0;
+    std::unique_ptr<android::fs_mgr::MetadataBuilder> builder_;
+};
+
+bool saveToDisk(PartitionBuilder builder);
+std::unique_ptr<android::fs_mgr::LpMetadata> exportMetadata(PartitionBuilder& builder);
+
+// Read-only view of one metadata slot. ReadMetadata only reads the geometry, the
+// header and the tables, and the name lookups are built once here, so queries never
+// construct (and validate) a MetadataBuilder.
+class MetadataIndex {
+public:
+    bool Load(const std::string& superPath, uint32_t slot);
+    bool Valid() const { return !!metadata_; }
+    bool IsFrom(const std::string& superPath, uint32_t slot) const {
+        return metadata_ && super_path_ == superPath && slot_ == slot;
+    }
+    const android::fs_mgr::LpMetadata& metadata() const { return *metadata_; }
+
+    const LpMetadataPartition* FindPartition(const std::string& name) const;
+    const LpMetadataPartitionGroup* FindGroup(const std::string& name) const;
+    std::string GroupName(const LpMetadataPartition& partition) const;
+    std::vector<std::string> ListGroups() const;
+    std::vector<const LpMetadataPartition*> ListPartitionsInGroup(const std::string& group) const;
+    uint64_t BytesOnDisk(const LpMetadataPartition& partition) const;
+    uint64_t AllocatableSpace() const;
+    uint64_t UsedSpace() const;
+
+private:
+    std::string super_path_;
+    uint32_t slot_ = 0;
+    std::unique_ptr<android::fs_mgr::LpMetadata> metadata_;
+    std::unordered_map<std::string, const LpMetadataPartition*> partitions_;
+    std::unordered_map<std::string, uint32_t> groups_;
+};
+
+bool fileOrBlockDeviceExists(const std::string& path);
+bool isDirectory(const std::string& path);
+bool isBlockDevice(const std::string& path);
+bool parseSize(const std::string& value, uint64_t* size);
+// |value| as a quoted JSON string.
+std::string jsonString(const std::string& value);
+
+// The group of system + |suffix|, which is what commands work on without --group.
+std::string detectGroup(const MetadataIndex& index, const std::string& suffix);
+uint64_t groupFreeSpace(const MetadataIndex& index, const std::string& groupName);
+
+// --alloc: where create and resize put the space a partition grows by. The default
+// leaves it to MetadataBuilder; contiguous fails rather than adding a new extent when
+// the partition cannot grow in place (or, while it is empty, fit in one free region).
+enum class AllocPolicy { kDefault, kBestFit, kContiguous, kEnd };
+bool parseAllocPolicy(const std::string& value, AllocPolicy* policy);
+
+// Command implementations. Each prints its own output and returns the exit code.
+int createPartition(PartitionBuilder& builder, const std::string& superPath, int slotValue,
+                    const std::string& groupValue, const std::string& partName, uint64_t partitionSize,
+                    AllocPolicy policy);
+// With |discard|, the extents a command releases are discarded after the commit.
+int removePartition(PartitionBuilder& builder, const std::string& superPath, const std::string& partName,
+                    bool discard);
+int resizePartition(PartitionBuilder& builder, const std::string& superPath, int slotValue,
+                    const std::string& partName, uint64_t partitionSize, bool discard, AllocPolicy policy);
+int replacePartition(PartitionBuilder& builder, const std::string& groupValue, const std::string& suffixValue,
+                     const std::string& OriginalPartName, const std::string& NewPartName);
+int mapPartitionCommand(const std::string& superPath, int slotValue, const std::string& partName);
+int unmapPartitionCommand(const std::string& partName);
+// With |all| set, |names| is replaced by every partition of |groupValue|.
+int mapPartitionsCommand(const MetadataIndex& index, const std::string& superPath, std::vector<std::string> names,
+                         bool all, const std::string& groupValue);
+int unmapPartitionsCommand(const MetadataIndex& index, std::vector<std::string> names, bool all,
+                           const std::string& groupValue);
+int printFreeSpace(const MetadataIndex& index, const std::string& groupValue);
+// --free --extents: every free region of super and a fragmentation score.
+int printFreeExtents(const MetadataIndex& index);
+int printGroupInfo(const MetadataIndex& index, const std::string& groupValue);
+void printJsonInfo(const MetadataIndex& index, const std::string& onlyGroup, int slotValue,
+                   const std::string& suffixValue, const std::string& superPath, const std::string& groupValue);
+int setUnlimitedGroup(PartitionBuilder& builder, const std::string& groupValue);
+int clearCow(PartitionBuilder& builder, const std::string& superPath, bool discard);
+// Sizes partitions to the end of their ext4 or erofs filesystem; |all| covers all of super.
+int shrinkToFit(PartitionBuilder& builder, const std::string& superPath, int slotValue,
+                std::vector<std::string> names, bool all, bool dryRun, bool discard);
+// Saves the metadata of every slot of super, with the extents each partition owns.
+int backupMetadata(const std::string& superPath, const std::string& outPath);
+// Writes a --backup-metadata file back unless a partition was given space since then
+// that the restored tables would hand to another partition.
+int restoreMetadata(const std::string& superPath, int slotValue, const std::string& backupPath, bool dryRun);
+int wipePartition(const MetadataIndex& index, const std::string& superPath, const std::string& partName);
+int runBatch(PartitionBuilder& builder, const std::string& batchPath, std::string groupValue,
+             const std::string& superPath, int slotValue);
+int flashPartition(PartitionBuilder& builder, const std::string& superPath, int slotValue,
+                   const std::string& partName, const std::string& imagePath, bool autoResize);
+int dumpPartition(const MetadataIndex& index, const std::string& superPath, const std::string& partName,
+                  const std::string& outPath, bool sparseOutput);
+int hashPartition(const MetadataIndex& index, const std::string& superPath, const std::string& partName,
+                  bool listChunks);
+// |referencePath| is either a raw image or the output of `--hash --chunks`.
+int verifyPartition(const MetadataIndex& index, const std::string& superPath, const std::string& partName,
+                    const std::string& referencePath);
+// Builds a complete raw or sparse super image from a layout manifest, without a device.
+int makeSuper(const std::string& manifestPath, const std::string& outPath, bool sparseOutput);
+int defragSuper(PartitionBuilder& builder, const std::string& superPath, int slotValue,
+                const std::string& scopeGroup, bool dryRun, const std::string& journalPath);
+int clonePartition(PartitionBuilder& builder, const std::string& superPath, int slotValue,
+                   const std::string& groupValue, const std::string& sourceName,
+                   const std::string& destinationName, bool verify);
+// Makes every partition ending in |fromSuffix| exist with the same size and contents
+// under |toSuffix|, writing only the blocks that differ.
+int syncSlot(PartitionBuilder& builder, const std::string& superPath, int slotValue, const std::string& fromSuffix,
+             const std::string& toSuffix, bool dryRun);
+int swapPartitions(PartitionBuilder& builder, const std::string& superPath, int slotValue,
+                   const std::vector<std::string>& names, bool rename);
+
+// --daemon: serves commands over a Unix socket, one JSON object per line in each
+// direction. Requests are {"id": ..., "args": ["--free"]} and answers carry the status
+// and the output the command printed. Reads use the cached tables, and mutations that
+// arrive within |commitDelay| of each other share one metadata write.
+inline constexpr const char* kDefaultDaemonSocket = "/dev/socket/lptools";
+
+struct DaemonOptions {
+    std::string socketPath = kDefaultDaemonSocket;
+    std::string superPath;
+    uint32_t slot = 0;
+    std::string suffix;
+    // Queued mutations are written to every metadata slot (--all-slots).
+    bool allSlots = false;
+    std::chrono::milliseconds commitDelay{20};
+};
+
+// Runs the command line of one request. |cached| holds the daemon's current tables.
+using DaemonCommandRunner = std::function<int(const std::vector<std::string>& args, const MetadataIndex* cached)>;
+int runDaemon(const DaemonOptions& options, const DaemonCommandRunner& runCommand);
+// --client: sends one command line to a daemon and prints its answer.
+int runClient(const std::string& socketPath, const std::vector<std::string>& args);
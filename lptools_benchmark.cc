@@ -0,0 +1,308 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+#include <benchmark/benchmark.h>
+#include <liblp/builder.h>
+#include <liblp/liblp.h>
+
+#include "lptools.h"
+
+using namespace android::fs_mgr;
+using android::base::StringPrintf;
+
+// Every synthetic partition is made of |fragments| extents of this size, and the
+// extents of all partitions are interleaved so that none of them is contiguous.
+static constexpr uint64_t kFragmentSize = 1024 * 1024;
+static constexpr uint32_t kMetadataSlots = 2;
+
+struct SuperLayout {
+    int partitions;
+    int groups;
+    int fragments;
+
+    bool operator<(const SuperLayout& other) const {
+        return std::tie(partitions, groups, fragments) < std::tie(other.partitions, other.groups, other.fragments);
+    }
+};
+
+static uint32_t metadataMaxSize(const SuperLayout& layout) {
+    uint64_t size = sizeof(LpMetadataHeader) + sizeof(LpMetadataBlockDevice) +
+                    layout.groups * sizeof(LpMetadataPartitionGroup) +
+                    layout.partitions * sizeof(LpMetadataPartition) +
+                    uint64_t(layout.partitions) * layout.fragments * sizeof(LpMetadataExtent);
+    // Room for the partitions the mutation benchmarks add.
+    size += 16 * 1024;
+    return (size + 4095) / 4096 * 4096;
+}
+
+// Writes a sparse super image file with |layout|. Partition 0 is system_a in
+// group_0, so group auto-detection has something to find.
+static bool createSuperImage(const std::string& path, const SuperLayout& layout) {
+    uint32_t metadataSize = metadataMaxSize(layout);
+    uint64_t dataSize = uint64_t(layout.partitions) * layout.fragments * kFragmentSize;
+    // Geometry, both copies of every slot, and free space for the mutation benchmarks.
+    uint64_t superSize = 2 * (LP_PARTITION_RESERVED_BYTES + LP_METADATA_GEOMETRY_SIZE +
+                              uint64_t(metadataSize) * kMetadataSlots) +
+                         dataSize + 256 * kFragmentSize;
+    superSize = (superSize + kDefaultPartitionAlignment - 1) / kDefaultPartitionAlignment * kDefaultPartitionAlignment;
+
+    BlockDeviceInfo device(LP_METADATA_DEFAULT_PARTITION_NAME, superSize, kDefaultPartitionAlignment, 0,
+                           kDefaultBlockSize);
+    auto builder = MetadataBuilder::New(device, metadataSize, kMetadataSlots);
+    if (!builder) {
+        return false;
+    }
+    auto empty = builder->Export();
+    if (!empty) {
+        return false;
+    }
+    uint64_t firstSector = empty->block_devices[0].first_logical_sector;
+    uint64_t alignmentSectors = kDefaultPartitionAlignment / LP_SECTOR_SIZE;
+    firstSector = (firstSector + alignmentSectors - 1) / alignmentSectors * alignmentSectors;
+
+    for (int i = 0; i < layout.groups; i++) {
+        if (!builder->AddGroup(StringPrintf("group_%d", i), 0)) {
+            return false;
+        }
+    }
+    std::vector<Partition*> partitions;
+    for (int i = 0; i < layout.partitions; i++) {
+        std::string name = i == 0 ? "system_a" : StringPrintf("part_%d", i);
+        auto partition = builder->AddPartition(name, StringPrintf("group_%d", i % layout.groups),
+                                               LP_PARTITION_ATTR_NONE);
+        if (partition == nullptr) {
+            return false;
+        }
+        partitions.push_back(partition);
+    }
+    // Laying the extents out directly keeps setup linear even for thousands of extents.
+    uint64_t sector = firstSector;
+    for (int f = 0; f < layout.fragments; f++) {
+        for (auto partition : partitions) {
+            partition->AddExtent(std::make_unique<LinearExtent>(kFragmentSize / LP_SECTOR_SIZE, 0, sector));
+            sector += kFragmentSize / LP_SECTOR_SIZE;
+        }
+    }
+    auto metadata = builder->Export();
+    if (!metadata) {
+        return false;
+    }
+
+    android::base::unique_fd fd(open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (fd < 0 || ftruncate(fd, superSize) != 0) {
+        return false;
+    }
+    fd.reset();
+    SuperPartitionOpener opener(path);
+    return FlashPartitionTable(opener, path, *metadata.get());
+}
+
+// Images are created once per layout and removed when the benchmark binary exits.
+class SuperImages {
+public:
+    ~SuperImages() {
+        for (const auto& [layout, path] : images_) {
+            unlink(path.c_str());
+        }
+    }
+
+    const std::string* Get(const SuperLayout& layout) {
+        auto it = images_.find(layout);
+        if (it != images_.end()) {
+            return &it->second;
+        }
+        const char* tmp = getenv("TMPDIR");
+        std::string path = StringPrintf("%s/lptools_benchmark_%d_%d_%d_%d.img", tmp ? tmp : "/tmp", getpid(),
+                                        layout.partitions, layout.groups, layout.fragments);
+        if (!createSuperImage(path, layout)) {
+            unlink(path.c_str());
+            return nullptr;
+        }
+        return &images_.emplace(layout, path).first->second;
+    }
+
+private:
+    std::map<SuperLayout, std::string> images_;
+};
+
+static SuperImages sImages;
+
+static const std::string* imageFor(benchmark::State& state) {
+    SuperLayout layout = {int(state.range(0)), int(state.range(1)), int(state.range(2))};
+    auto path = sImages.Get(layout);
+    if (path == nullptr) {
+        state.SkipWithError("unable to create super image");
+    }
+    return path;
+}
+
+static void BM_LoadMetadataIndex(benchmark::State& state) {
+    auto path = imageFor(state);
+    if (path == nullptr) return;
+    for (auto _ : state) {
+        MetadataIndex index;
+        benchmark::DoNotOptimize(index.Load(*path, 0));
+    }
+}
+
+static void BM_LoadBuilder(benchmark::State& state) {
+    auto path = imageFor(state);
+    if (path == nullptr) return;
+    for (auto _ : state) {
+        MetadataIndex index;
+        if (!index.Load(*path, 0)) {
+            state.SkipWithError("unable to read metadata");
+            break;
+        }
+        PartitionBuilder builder(index.metadata(), 0, *path);
+        benchmark::DoNotOptimize(builder.Valid());
+    }
+}
+
+static void BM_DetectGroup(benchmark::State& state) {
+    auto path = imageFor(state);
+    if (path == nullptr) return;
+    MetadataIndex index;
+    if (!index.Load(*path, 0)) {
+        state.SkipWithError("unable to read metadata");
+        return;
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(detectGroup(index, "_a"));
+    }
+}
+
+// Loads a builder for the mutation benchmarks, which reuse it across iterations.
+static bool loadBuilder(benchmark::State& state, const std::string& path, PartitionBuilder* builder) {
+    MetadataIndex index;
+    if (index.Load(path, 0)) {
+        *builder = PartitionBuilder(index.metadata(), 0, path);
+    }
+    if (!builder->Valid()) {
+        state.SkipWithError("unable to load metadata");
+        return false;
+    }
+    return true;
+}
+
+static void BM_CreateRemovePartition(benchmark::State& state) {
+    auto path = imageFor(state);
+    PartitionBuilder builder;
+    if (path == nullptr || !loadBuilder(state, *path, &builder)) return;
+    for (auto _ : state) {
+        auto partition = builder->AddPartition("bench_new", "group_0", LP_PARTITION_ATTR_NONE);
+        if (partition == nullptr || !builder->ResizePartition(partition, 4 * kFragmentSize)) {
+            state.SkipWithError("unable to create partition");
+            break;
+        }
+        builder->RemovePartition("bench_new");
+    }
+}
+
+static void BM_ResizePartition(benchmark::State& state) {
+    auto path = imageFor(state);
+    PartitionBuilder builder;
+    if (path == nullptr || !loadBuilder(state, *path, &builder)) return;
+    auto partition = builder->FindPartition("system_a");
+    uint64_t size = partition->size();
+    for (auto _ : state) {
+        if (!builder->ResizePartition(partition, size + 4 * kFragmentSize) ||
+            !builder->ResizePartition(partition, size)) {
+            state.SkipWithError("unable to resize partition");
+            break;
+        }
+    }
+}
+
+static void BM_Export(benchmark::State& state) {
+    auto path = imageFor(state);
+    PartitionBuilder builder;
+    if (path == nullptr || !loadBuilder(state, *path, &builder)) return;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(builder->Export());
+    }
+}
+
+// Alternates between two layouts so that every iteration really writes the tables
+// instead of taking the unchanged-metadata shortcut.
+static void BM_UpdatePartitionTable(benchmark::State& state) {
+    auto path = imageFor(state);
+    PartitionBuilder builder;
+    if (path == nullptr || !loadBuilder(state, *path, &builder)) return;
+    auto original = builder->Export();
+    auto partition = builder->FindPartition("system_a");
+    if (partition == nullptr || !builder->ResizePartition(partition, partition->size() + kFragmentSize)) {
+        state.SkipWithError("unable to resize partition");
+        return;
+    }
+    auto grown = builder->Export();
+    if (!original || !grown) {
+        state.SkipWithError("unable to export metadata");
+        return;
+    }
+    const LpMetadata* layouts[] = {grown.get(), original.get()};
+    size_t next = 0;
+    for (auto _ : state) {
+        if (!UpdateAllPartitionMetadata(*path, *layouts[next], 0)) {
+            state.SkipWithError("unable to write metadata");
+            break;
+        }
+        next ^= 1;
+    }
+    // Leave the image as the other benchmarks expect it.
+    if (next == 1 && !UpdateAllPartitionMetadata(*path, *original.get(), 0)) {
+        state.SkipWithError("unable to restore metadata");
+    }
+}
+
+// Writing tables identical to those on disk only costs the read and compare.
+static void BM_UpdatePartitionTableUnchanged(benchmark::State& state) {
+    auto path = imageFor(state);
+    PartitionBuilder builder;
+    if (path == nullptr || !loadBuilder(state, *path, &builder)) return;
+    auto metadata = builder->Export();
+    if (!metadata) {
+        state.SkipWithError("unable to export metadata");
+        return;
+    }
+    for (auto _ : state) {
+        if (!UpdateAllPartitionMetadata(*path, *metadata.get(), 0)) {
+            state.SkipWithError("unable to write metadata");
+            break;
+        }
+    }
+}
+
+// partitions x groups x fragments per partition.
+static void SuperLayouts(benchmark::internal::Benchmark* b) {
+    for (int partitions : {10, 100, 1000, 4000}) {
+        for (int groups : {1, 8}) {
+            for (int fragments : {1, 8}) {
+                b->Args({partitions, groups, fragments});
+            }
+        }
+    }
+    b->ArgNames({"partitions", "groups", "fragments"});
+    b->Unit(benchmark::kMicrosecond);
+    b->Repetitions(5);
+    b->ReportAggregatesOnly(true);
+}
+
+BENCHMARK(BM_LoadMetadataIndex)->Apply(SuperLayouts);
+BENCHMARK(BM_LoadBuilder)->Apply(SuperLayouts);
+BENCHMARK(BM_DetectGroup)->Apply(SuperLayouts);
+BENCHMARK(BM_CreateRemovePartition)->Apply(SuperLayouts);
+BENCHMARK(BM_ResizePartition)->Apply(SuperLayouts);
+BENCHMARK(BM_Export)->Apply(SuperLayouts);
+BENCHMARK(BM_UpdatePartitionTable)->Apply(SuperLayouts)->UseRealTime();
+BENCHMARK(BM_UpdatePartitionTableUnchanged)->Apply(SuperLayouts)->UseRealTime();
+
+BENCHMARK_MAIN();
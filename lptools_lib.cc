@@ -0,0 +1,5390 @@
+#include "lptools.h"
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sys/stat.h>
+#include <cmath>
+#include <cstring>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <regex>
+#include <chrono>
+#include <set>
+#include <thread>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <linux/dm-ioctl.h>
+#include <linux/fs.h>
+#include <linux/memfd.h>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <cutils/android_get_control_file.h>
+#include <cutils/sockets.h>
+#include <ext4_utils/ext4_sb.h>
+#include <fs_mgr.h>
+#include <liblp/builder.h>
+#include <liblp/liblp.h>
+#include <fs_mgr_dm_linear.h>
+#include <libdm/dm.h>
+#include <openssl/sha.h>
+#include <sparse/sparse.h>
+#ifndef LPTOOLS_STATIC
+#include <android/hardware/boot/1.1/IBootControl.h>
+#include <android/hardware/boot/1.1/types.h>
+#endif
+
+using namespace android;
+using namespace android::fs_mgr;
+using namespace std;
+using namespace std::literals;
+
+
+string SuperPartitionOpener::Resolve(const string& partition_name) const {
+    if (partition_name == LP_METADATA_DEFAULT_PARTITION_NAME || partition_name == super_path_) {
+        return super_path_;
+    }
+    return partition_name;
+}
+
+android::base::unique_fd SuperPartitionOpener::Open(const string& partition_name, int flags) const {
+    string path = Resolve(partition_name);
+    if (path != super_path_) {
+        return PartitionOpener::Open(path, flags);
+    }
+    if (defer_sync_) {
+        flags &= ~O_SYNC;
+    }
+    // PartitionOpener would look a relative --super up under /dev/block/by-name.
+    return android::base::unique_fd(open(path.c_str(), flags | O_CLOEXEC));
+}
+
+bool SuperPartitionOpener::GetInfo(const string& partition_name, BlockDeviceInfo* info) const {
+    string path = Resolve(partition_name);
+    struct stat st;
+    if (path != super_path_ || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return PartitionOpener::GetInfo(path, info);
+    }
+    // Zero alignment keeps whatever the metadata recorded for the device.
+    info->size = st.st_size;
+    info->alignment = 0;
+    info->alignment_offset = 0;
+    info->logical_block_size = kDefaultBlockSize;
+    return true;
+}
+
+string SuperPartitionOpener::GetDeviceString(const string& partition_name) const {
+    return PartitionOpener::GetDeviceString(Resolve(partition_name));
+}
+
+
+struct TraceEvent {
+    string name;
+    string detail;
+    int64_t start_us;
+    int64_t duration_us;
+    int64_t cpu_us;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    pid_t tid;
+};
+
+static std::atomic<bool> sTracing{false};
+static std::mutex sTraceLock;
+static std::vector<TraceEvent> sTraceEvents;
+static std::chrono::steady_clock::time_point sTraceStart;
+
+static int64_t traceNowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sTraceStart)
+            .count();
+}
+
+static int64_t processCpuUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// rchar/wchar count what read()/write() and friends transferred, including O_DIRECT.
+static void processIoBytes(uint64_t* read, uint64_t* written) {
+    *read = *written = 0;
+    std::ifstream io("/proc/self/io");
+    string key;
+    uint64_t value;
+    while (io >> key >> value) {
+        if (key == "rchar:") {
+            *read = value;
+        } else if (key == "wchar:") {
+            *written = value;
+        }
+    }
+}
+
+TraceScope::TraceScope(const char* name, string detail) : name_(name) {
+    if (!sTracing) {
+        return;
+    }
+    active_ = true;
+    detail_ = std::move(detail);
+    processIoBytes(&read_start_, &write_start_);
+    cpu_start_us_ = processCpuUs();
+    start_us_ = traceNowUs();
+}
+
+TraceScope::~TraceScope() {
+    if (!active_) {
+        return;
+    }
+    int64_t end = traceNowUs();
+    int64_t cpu = processCpuUs() - cpu_start_us_;
+    uint64_t read, written;
+    processIoBytes(&read, &written);
+    std::lock_guard<std::mutex> lock(sTraceLock);
+    sTraceEvents.push_back({name_, std::move(detail_), start_us_, end - start_us_, cpu, read - read_start_,
+                            written - write_start_, pid_t(syscall(SYS_gettid))});
+}
+
+static bool writeChromeTrace(const string& path) {
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) {
+        std::cerr << "Unable to open " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    pid_t pid = getpid();
+    for (size_t i = 0; i < sTraceEvents.size(); i++) {
+        const auto& event = sTraceEvents[i];
+        out << (i ? "," : "") << "\n{\"name\":" << jsonString(event.name) << ",\"cat\":\"lptools\",\"ph\":\"X\""
+            << ",\"ts\":" << event.start_us << ",\"dur\":" << event.duration_us << ",\"pid\":" << pid
+            << ",\"tid\":" << event.tid << ",\"args\":{\"cpu_us\":" << event.cpu_us
+            << ",\"bytes_read\":" << event.bytes_read << ",\"bytes_written\":" << event.bytes_written;
+        if (!event.detail.empty()) {
+            out << ",\"detail\":" << jsonString(event.detail);
+        }
+        out << "}}";
+    }
+    out << "\n]}\n";
+    out.close();
+    if (!out) {
+        std::cerr << "Unable to write " << path << std::endl;
+        return false;
+    }
+    std::cerr << "Wrote " << sTraceEvents.size() << " trace events to " << path << std::endl;
+    return true;
+}
+
+// One line per phase name in order of first appearance. Nested phases are also
+// counted in their parents, so the columns do not add up.
+static void printTraceSummary() {
+    struct Totals {
+        size_t count = 0;
+        int64_t wall_us = 0;
+        int64_t cpu_us = 0;
+        uint64_t bytes_read = 0;
+        uint64_t bytes_written = 0;
+    };
+    std::vector<string> order;
+    std::unordered_map<string, Totals> totals;
+    for (const auto& event : sTraceEvents) {
+        auto [it, inserted] = totals.emplace(event.name, Totals());
+        if (inserted) {
+            order.push_back(event.name);
+        }
+        it->second.count++;
+        it->second.wall_us += event.duration_us;
+        it->second.cpu_us += event.cpu_us;
+        it->second.bytes_read += event.bytes_read;
+        it->second.bytes_written += event.bytes_written;
+    }
+    fprintf(stderr, "%-24s %6s %12s %12s %14s %14s\n", "phase", "count", "wall ms", "cpu ms", "read", "written");
+    for (const auto& name : order) {
+        const auto& t = totals[name];
+        fprintf(stderr, "%-24s %6zu %12.3f %12.3f %14" PRIu64 " %14" PRIu64 "\n", name.c_str(), t.count,
+                t.wall_us / 1000.0, t.cpu_us / 1000.0, t.bytes_read, t.bytes_written);
+    }
+}
+
+TraceSession::TraceSession(bool enabled, string path) : enabled_(enabled), path_(std::move(path)) {
+    if (enabled_) {
+        sTraceStart = std::chrono::steady_clock::now();
+        sTracing = true;
+    }
+}
+
+TraceSession::~TraceSession() {
+    if (!enabled_) {
+        return;
+    }
+    sTracing = false;
+    std::lock_guard<std::mutex> lock(sTraceLock);
+    // Events are recorded when a scope ends; Chrome trace wants them by start time.
+    std::stable_sort(sTraceEvents.begin(), sTraceEvents.end(),
+                     [](const TraceEvent& a, const TraceEvent& b) { return a.start_us < b.start_us; });
+    if (path_.empty()) {
+        printTraceSummary();
+    } else {
+        writeChromeTrace(path_);
+    }
+    sTraceEvents.clear();
+}
+
+
+static bool sCommitAllSlots = false;
+
+void setCommitAllSlots(bool allSlots) {
+    sCommitAllSlots = allSlots;
+}
+
+template <typename T>
+static bool tablesEqual(const std::vector<T>& a, const std::vector<T>& b) {
+    return a.size() == b.size() && (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+}
+
+// Checksums and table offsets are computed when the tables are serialized, so only
+// what goes into them is compared.
+bool metadataEquals(const LpMetadata& a, const LpMetadata& b) {
+    return a.geometry.metadata_max_size == b.geometry.metadata_max_size &&
+           a.geometry.metadata_slot_count == b.geometry.metadata_slot_count &&
+           a.geometry.logical_block_size == b.geometry.logical_block_size &&
+           a.header.major_version == b.header.major_version &&
+           a.header.minor_version == b.header.minor_version && a.header.flags == b.header.flags &&
+           tablesEqual(a.partitions, b.partitions) && tablesEqual(a.extents, b.extents) &&
+           tablesEqual(a.groups, b.groups) && tablesEqual(a.block_devices, b.block_devices);
+}
+
+bool UpdateAllPartitionMetadata(const string& super_name,
+                                const android::fs_mgr::LpMetadata& metadata,
+                                const uint32_t user_slot) {
+    TraceScope trace("UpdatePartitionTable");
+    std::vector<uint32_t> slots = {user_slot};
+    if (sCommitAllSlots) {
+        slots.clear();
+        for (uint32_t slot = 0; slot < metadata.geometry.metadata_slot_count; slot++) {
+            slots.push_back(slot);
+        }
+    }
+    SuperPartitionOpener opener(super_name);
+    // liblp opens super with O_SYNC for every copy it writes; several slots are
+    // flushed together instead.
+    opener.set_defer_sync(slots.size() > 1);
+    bool ok = true;
+    size_t written = 0;
+    for (uint32_t slot : slots) {
+        auto current = ReadMetadata(opener, super_name, slot);
+        if (current && metadataEquals(*current, metadata)) {
+            std::cout << "Metadata slot " << slot << " is unchanged, not writing it" << std::endl;
+            continue;
+        }
+        ok &= UpdatePartitionTable(opener, super_name, metadata, slot);
+        written++;
+    }
+    if (written > 0 && slots.size() > 1) {
+        android::base::unique_fd fd(opener.Open(super_name, O_RDWR));
+        if (fd < 0 || fsync(fd) != 0) {
+            std::cerr << "Unable to sync " << super_name << ": " << strerror(errno) << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+PartitionBuilder::PartitionBuilder(string user_suffix, bool user_slot, string user_super) {
+    slot_number_ = user_slot;
+    slot_suffix_ = user_suffix;
+    auto super_device = std::move(user_super);
+    super_device_ = std::move(super_device);
+    TraceScope trace("PartitionBuilder");
+    SuperPartitionOpener opener(super_device_);
+    builder_ = MetadataBuilder::New(opener, super_device_, slot_number_);
+}
+PartitionBuilder::PartitionBuilder(const LpMetadata& metadata, uint32_t user_slot, string user_super) {
+    slot_number_ = user_slot;
+    super_device_ = std::move(user_super);
+    TraceScope trace("PartitionBuilder");
+    SuperPartitionOpener opener(super_device_);
+    builder_ = MetadataBuilder::New(metadata, &opener);
+}
+bool saveToDisk(PartitionBuilder builder) {
+    TraceScope trace("saveToDisk");
+    return builder.Write();
+}
+std::unique_ptr<LpMetadata> exportMetadata(PartitionBuilder& builder) {
+    TraceScope trace("Export");
+    return builder->Export();
+}
+bool PartitionBuilder::Write() {
+    auto metadata = exportMetadata(*this);
+    if (!metadata) {
+        return false;
+    }
+    return UpdateAllPartitionMetadata(super_device_, *metadata.get(), slot_number_);
+}
+
+
+bool fileOrBlockDeviceExists(const string& path) {
+    std::ifstream file(path);
+    return file.good();
+}
+bool isDirectory(const string& path) {
+    struct stat path_stat;
+    stat(path.c_str(), &path_stat);
+    return S_ISDIR(path_stat.st_mode);
+}
+bool isBlockDevice(const string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISBLK(st.st_mode);
+}
+inline bool ends_with(string const & value, string const & ending)
+{
+    if (ending.size() > value.size()) return false;
+    return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
+}
+
+bool parseSize(const string& value, uint64_t* size) {
+    char* end;
+    errno = 0;
+    auto parsed = strtoll(value.c_str(), &end, 0);
+    if (value.empty() || errno == ERANGE || *end != '\0' || parsed < 0) {
+        return false;
+    }
+    *size = parsed;
+    return true;
+}
+
+bool mapPartition(const string& superPath, int slotValue, const string& partName, string* dmPath) {
+    CreateLogicalPartitionParams params {
+            .block_device = superPath,
+            .metadata_slot = slotValue,
+            .partition_name = partName,
+            .timeout_ms = std::chrono::milliseconds(10000),
+            .force_writable = true,
+    };
+    // Includes the wait for the device node.
+    TraceScope trace("CreateLogicalPartition", partName);
+    return android::fs_mgr::CreateLogicalPartition(params, dmPath);
+}
+
+bool destroyLogicalPartition(const string& partName) {
+    TraceScope trace("DestroyLogicalPartition", partName);
+    return android::fs_mgr::DestroyLogicalPartition(partName);
+}
+
+bool isMapped(const string& partName) {
+    return android::dm::DeviceMapper::Instance().GetState(partName) == android::dm::DmDeviceState::ACTIVE;
+}
+
+// Runs fn(i) for every i in [0, count) on up to |workers| threads.
+template <typename Fn>
+void parallelFor(size_t count, size_t workers, Fn fn) {
+    workers = std::max<size_t>(1, std::min(workers, count));
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < workers; t++) {
+        threads.emplace_back([&] {
+            for (size_t i = next++; i < count; i = next++) {
+                fn(i);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Blocks until every path in |paths| exists. Instead of polling, the parent
+// directories are watched with inotify so we wake up as soon as ueventd creates
+// the node. Paths that are still missing at the deadline are left in |paths|.
+bool waitForDeviceNodes(std::vector<string>* paths, std::chrono::milliseconds timeout) {
+    TraceScope trace("WaitForDeviceNodes");
+    android::base::unique_fd inotifyFd(inotify_init1(IN_CLOEXEC | IN_NONBLOCK));
+    if (inotifyFd < 0) {
+        std::cerr << "inotify_init1 failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::set<string> directories;
+    for (const auto& path : *paths) {
+        directories.insert(android::base::Dirname(path));
+    }
+    for (const auto& directory : directories) {
+        inotify_add_watch(inotifyFd, directory.c_str(), IN_CREATE | IN_MOVED_TO | IN_ATTRIB);
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        paths->erase(std::remove_if(paths->begin(), paths->end(),
+                                    [](const string& path) { return access(path.c_str(), F_OK) == 0; }),
+                     paths->end());
+        if (paths->empty()) {
+            return true;
+        }
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) {
+            return false;
+        }
+        struct pollfd pfd = {.fd = inotifyFd, .events = POLLIN};
+        if (poll(&pfd, 1, left.count()) < 0 && errno != EINTR) {
+            return false;
+        }
+        while (read(inotifyFd, events, sizeof(events)) > 0) {
+        }
+    }
+}
+
+static constexpr size_t kMapWorkers = 8;
+
+struct MapResult {
+    string name;
+    string path;
+    bool ok = false;
+};
+
+// Creates the dm devices for |names| concurrently from one copy of the metadata and
+// then waits for all of their device nodes together. Partitions that are already
+// mapped report their existing path.
+bool mapPartitions(const LpMetadata& metadata, const string& superPath,
+                   const std::vector<string>& names, std::vector<MapResult>* results) {
+    results->assign(names.size(), MapResult());
+    parallelFor(names.size(), kMapWorkers, [&](size_t i) {
+        auto& result = (*results)[i];
+        result.name = names[i];
+        if (isMapped(names[i])) {
+            result.ok = android::dm::DeviceMapper::Instance().GetDmDevicePathByName(names[i], &result.path);
+            return;
+        }
+        CreateLogicalPartitionParams params {
+                .block_device = superPath,
+                .metadata = &metadata,
+                .partition_name = names[i],
+                .force_writable = true,
+        };
+        TraceScope trace("CreateLogicalPartition", names[i]);
+        result.ok = android::fs_mgr::CreateLogicalPartition(params, &result.path);
+    });
+
+    std::vector<string> pending;
+    for (const auto& result : *results) {
+        if (result.ok) {
+            pending.push_back(result.path);
+        }
+    }
+    waitForDeviceNodes(&pending, std::chrono::milliseconds(10000));
+    bool ok = true;
+    for (auto& result : *results) {
+        if (result.ok && std::find(pending.begin(), pending.end(), result.path) != pending.end()) {
+            result.ok = false;
+        }
+        ok &= result.ok;
+    }
+    return ok;
+}
+
+// Tears down the dm devices of |names| concurrently. Names that are not mapped are
+// reported as successfully unmapped.
+bool unmapPartitions(const std::vector<string>& names, std::vector<bool>* results) {
+    results->assign(names.size(), false);
+    parallelFor(names.size(), kMapWorkers, [&](size_t i) {
+        (*results)[i] = !isMapped(names[i]) || destroyLogicalPartition(names[i]);
+    });
+    return std::find(results->begin(), results->end(), false) == results->end();
+}
+
+// Swaps the table of an active dm device for one built from |metadata| instead of
+// destroying and recreating it. The new table is loaded into the inactive slot and
+// the resume swaps it in, so the device is suspended only once and keeps its path
+// and minor number.
+bool reloadPartition(const LpMetadata& metadata, const string& superPath, const string& partName) {
+    CreateLogicalPartitionParams params {
+            .block_device = superPath,
+            .metadata = &metadata,
+            .partition_name = partName,
+            .force_writable = true,
+    };
+    android::dm::DmTable table;
+    if (!android::fs_mgr::CreateDmTable(params, &table)) {
+        std::cerr << "Unable to build dm table for " << partName << std::endl;
+        return false;
+    }
+    TraceScope trace("LoadTableAndActivate", partName);
+    auto start = std::chrono::steady_clock::now();
+    if (!android::dm::DeviceMapper::Instance().LoadTableAndActivate(partName, table)) {
+        std::cerr << "Unable to reload dm table for " << partName << std::endl;
+        return false;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    std::cout << "Reloaded dm table for " << partName << " in " << elapsed.count() << "us" << std::endl;
+    return true;
+}
+
+// Reloads every mapped partition of |names| from |metadata|. A device whose table
+// cannot be reloaded is unmapped and appended to |toMap| so it is recreated instead.
+// Returns false if a device could be neither reloaded nor unmapped, i.e. it still
+// points at the old extents.
+bool reloadMappedPartitions(const LpMetadata& metadata, const string& superPath,
+                            const std::vector<string>& names, std::vector<string>* toMap) {
+    bool ok = true;
+    for (const auto& partName : names) {
+        if (!isMapped(partName) || reloadPartition(metadata, superPath, partName)) {
+            continue;
+        }
+        if (destroyLogicalPartition(partName)) {
+            toMap->push_back(partName);
+        } else {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static constexpr size_t kIoBufferSize = 4 * 1024 * 1024;
+static constexpr size_t kIoQueueDepth = 4;
+static constexpr uint64_t kDirectIoAlignment = 4096;
+
+struct FreeDeleter {
+    void operator()(void* ptr) const { free(ptr); }
+};
+using AlignedBuffer = std::unique_ptr<uint8_t[], FreeDeleter>;
+
+AlignedBuffer allocateAligned(size_t size) {
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, kDirectIoAlignment, size) != 0) {
+        return nullptr;
+    }
+    return AlignedBuffer(static_cast<uint8_t*>(ptr));
+}
+
+// The shared I/O layer of the bulk data paths. Every large read or write of partition
+// data asks the throttle first; it costs one relaxed load while no limit is set.
+static constexpr double kMinIoRate = 1024 * 1024;
+static constexpr auto kIoBurst = std::chrono::milliseconds(50);
+static constexpr auto kIoRecoveryInterval = std::chrono::seconds(1);
+static constexpr int kIoprioWhoProcess = 1;
+static constexpr int kIoprioClassShift = 13;
+
+class IoThrottle {
+public:
+    void Configure(const IoLimits& limits);
+    bool Active() const { return active_.load(std::memory_order_relaxed); }
+    // Blocks until the token bucket has room for |bytes|.
+    void Acquire(uint64_t bytes);
+    // With a latency target, halves the rate after a slow write and raises it again
+    // once writes have been fast for a while.
+    void ObserveWrite(std::chrono::steady_clock::duration latency);
+    void Report();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    std::atomic<bool> active_{false};
+    std::mutex lock_;
+    double maxRate_ = 0;
+    double rate_ = 0;
+    Clock::duration latencyTarget_{};
+    Clock::time_point next_;
+    Clock::time_point start_;
+    Clock::time_point lastChange_;
+    uint64_t bytes_ = 0;
+    Clock::duration waited_{};
+    int backoffs_ = 0;
+};
+
+static IoThrottle sIoThrottle;
+
+void IoThrottle::Configure(const IoLimits& limits) {
+    std::lock_guard<std::mutex> guard(lock_);
+    maxRate_ = limits.maxRate;
+    rate_ = maxRate_;
+    latencyTarget_ = limits.latencyTarget;
+    next_ = start_ = lastChange_ = Clock::now();
+    bytes_ = 0;
+    waited_ = {};
+    backoffs_ = 0;
+    active_ = limits.maxRate > 0 || limits.latencyTarget.count() > 0;
+}
+
+void IoThrottle::Acquire(uint64_t bytes) {
+    if (!Active()) {
+        return;
+    }
+    Clock::duration wait{};
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        auto now = Clock::now();
+        if (bytes_ == 0) {
+            start_ = now;
+        }
+        bytes_ += bytes;
+        if (rate_ > 0) {
+            next_ = std::max(next_, now - std::chrono::duration_cast<Clock::duration>(kIoBurst));
+            wait = std::max(next_ - now, Clock::duration::zero());
+            next_ += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(bytes / rate_));
+            waited_ += wait;
+        }
+    }
+    if (wait > Clock::duration::zero()) {
+        std::this_thread::sleep_for(wait);
+    }
+}
+
+void IoThrottle::ObserveWrite(Clock::duration latency) {
+    if (!Active() || latencyTarget_ == Clock::duration::zero()) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(lock_);
+    auto now = Clock::now();
+    if (latency > latencyTarget_) {
+        // Writes of the other workers that were already queued come back slow too, so
+        // one backoff per latency window.
+        if (now - lastChange_ < latencyTarget_) {
+            return;
+        }
+        double elapsed = std::chrono::duration<double>(now - start_).count();
+        double current = rate_ > 0 ? rate_ : (elapsed > 0 ? bytes_ / elapsed : kMinIoRate);
+        rate_ = std::max(kMinIoRate, current / 2);
+        backoffs_++;
+        lastChange_ = now;
+    } else if (rate_ > 0 && rate_ != maxRate_ && now - lastChange_ >= kIoRecoveryInterval) {
+        rate_ *= 1.25;
+        if (maxRate_ > 0 && rate_ > maxRate_) {
+            rate_ = maxRate_;
+        }
+        lastChange_ = now;
+    }
+}
+
+void IoThrottle::Report() {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (!Active() || bytes_ == 0) {
+        return;
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start_).count();
+    fprintf(stderr, "I/O: %" PRIu64 " bytes in %.2f s, %.2f MB/s, %.2f s throttled (summed over threads)",
+            bytes_, seconds, seconds > 0 && bytes_ > 0 ? bytes_ / 1024.0 / 1024.0 / seconds : 0.0,
+            std::chrono::duration<double>(waited_).count());
+    if (latencyTarget_ != Clock::duration::zero()) {
+        fprintf(stderr, ", %d backoff(s), last rate %s", backoffs_,
+                rate_ > 0 ? android::base::StringPrintf("%.2f MB/s", rate_ / 1024 / 1024).c_str() : "unlimited");
+    }
+    fprintf(stderr, "\n");
+}
+
+bool parseIoniceClass(const string& value, IoLimits* limits) {
+    auto parts = android::base::Split(value, ":");
+    int level = 4;
+    if (parts.size() > 2 || (parts.size() == 2 && !android::base::ParseInt(parts[1], &level, 0, 7))) {
+        return false;
+    }
+    if (parts[0] == "realtime" || parts[0] == "rt" || parts[0] == "1") {
+        limits->ioprioClass = 1;
+    } else if (parts[0] == "best-effort" || parts[0] == "be" || parts[0] == "2") {
+        limits->ioprioClass = 2;
+    } else if ((parts[0] == "idle" || parts[0] == "3") && parts.size() == 1) {
+        limits->ioprioClass = 3;
+        level = 0;
+    } else {
+        return false;
+    }
+    limits->ioprioLevel = level;
+    return true;
+}
+
+// Threads inherit the I/O priority of the thread that creates them, so setting it
+// before a command starts its workers covers all of them.
+IoSession::IoSession(const IoLimits& limits) {
+    if (limits.ioprioClass != 0) {
+        previousIoprio_ = syscall(SYS_ioprio_get, kIoprioWhoProcess, 0);
+        int ioprio = (limits.ioprioClass << kIoprioClassShift) | limits.ioprioLevel;
+        if (syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, ioprio) != 0) {
+            std::cerr << "Warning: unable to set the I/O priority: " << strerror(errno) << std::endl;
+            previousIoprio_ = -1;
+        }
+    }
+    sIoThrottle.Configure(limits);
+}
+
+IoSession::~IoSession() {
+    sIoThrottle.Report();
+    sIoThrottle.Configure(IoLimits());
+    if (previousIoprio_ >= 0) {
+        syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, previousIoprio_);
+    }
+}
+
+// ReadFullyAtOffset and WriteFullyAtOffset through the throttle. Writes also feed
+// their latency to the adaptive mode.
+bool throttledReadAt(int fd, void* data, size_t length, uint64_t offset) {
+    sIoThrottle.Acquire(length);
+    return android::base::ReadFullyAtOffset(fd, data, length, offset);
+}
+
+bool throttledWriteAt(int fd, const void* data, size_t length, uint64_t offset) {
+    sIoThrottle.Acquire(length);
+    auto start = std::chrono::steady_clock::now();
+    bool ok = android::base::WriteFullyAtOffset(fd, data, length, offset);
+    sIoThrottle.ObserveWrite(std::chrono::steady_clock::now() - start);
+    return ok;
+}
+
+// Where a piece of a partition lives on super. |zero| ranges have no backing
+// storage and always read back as zeroes.
+struct PartitionRange {
+    uint64_t logical;
+    uint64_t physical;
+    uint64_t length;
+    bool zero;
+};
+
+bool getPartitionRanges(const Partition* partition, std::vector<PartitionRange>* ranges) {
+    uint64_t logical = 0;
+    for (const auto& extent : partition->extents()) {
+        PartitionRange range = {logical, 0, extent->num_sectors() * LP_SECTOR_SIZE, true};
+        auto linear = extent->AsLinearExtent();
+        if (linear != nullptr) {
+            if (linear->device_index() != 0) {
+                std::cerr << "Partition " << partition->name() << " has extents outside of super, which is not supported" << std::endl;
+                return false;
+            }
+            range.physical = linear->physical_sector() * LP_SECTOR_SIZE;
+            range.zero = false;
+        }
+        ranges->push_back(range);
+        logical += range.length;
+    }
+    return true;
+}
+
+// Writes partition-relative data to the matching physical offsets on super. Aligned
+// requests go through an O_DIRECT descriptor so multi-GB writes bypass the page
+// cache; anything unaligned (usually the tail of a raw image) uses a buffered one.
+class ExtentWriter {
+public:
+    bool Open(const string& superPath, std::vector<PartitionRange> ranges);
+    bool Write(uint64_t logical, const uint8_t* data, uint64_t length);
+    bool Sync();
+
+private:
+    android::base::unique_fd fd_;
+    android::base::unique_fd directFd_;
+    std::vector<PartitionRange> ranges_;
+};
+
+bool ExtentWriter::Open(const string& superPath, std::vector<PartitionRange> ranges) {
+    ranges_ = std::move(ranges);
+    fd_.reset(open(superPath.c_str(), O_WRONLY | O_CLOEXEC));
+    if (fd_ < 0) {
+        std::cerr << "Unable to open " << superPath << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    // Some filesystems (tmpfs) reject O_DIRECT, image files there just stay buffered.
+    directFd_.reset(open(superPath.c_str(), O_WRONLY | O_CLOEXEC | O_DIRECT));
+    return true;
+}
+
+bool ExtentWriter::Write(uint64_t logical, const uint8_t* data, uint64_t length) {
+    for (const auto& range : ranges_) {
+        if (length == 0) {
+            break;
+        }
+        if (logical < range.logical || logical >= range.logical + range.length) {
+            continue;
+        }
+        uint64_t chunk = std::min(length, range.logical + range.length - logical);
+        if (range.zero) {
+            std::cerr << "Unable to write to a zero extent at offset " << logical << std::endl;
+            return false;
+        }
+        uint64_t physical = range.physical + (logical - range.logical);
+        bool aligned = physical % kDirectIoAlignment == 0 && chunk % kDirectIoAlignment == 0 &&
+                       reinterpret_cast<uintptr_t>(data) % kDirectIoAlignment == 0;
+        int fd = (aligned && directFd_ >= 0) ? directFd_.get() : fd_.get();
+        if (!throttledWriteAt(fd, data, chunk, physical)) {
+            std::cerr << "Write to super failed at " << physical << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        logical += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+    if (length != 0) {
+        std::cerr << "Write past the end of the partition at offset " << logical << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool ExtentWriter::Sync() {
+    if (fsync(fd_) != 0) {
+        std::cerr << "fsync failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Reads partition-relative data from the matching physical offsets on super. Zero
+// ranges are filled in memory without touching the disk.
+class ExtentReader {
+public:
+    bool Open(const string& superPath, std::vector<PartitionRange> ranges);
+    bool Read(uint64_t logical, uint8_t* data, uint64_t length);
+    int fd() const { return fd_.get(); }
+    const std::vector<PartitionRange>& ranges() const { return ranges_; }
+
+private:
+    android::base::unique_fd fd_;
+    std::vector<PartitionRange> ranges_;
+};
+
+bool ExtentReader::Open(const string& superPath, std::vector<PartitionRange> ranges) {
+    ranges_ = std::move(ranges);
+    fd_.reset(open(superPath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd_ < 0) {
+        std::cerr << "Unable to open " << superPath << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return true;
+}
+
+bool ExtentReader::Read(uint64_t logical, uint8_t* data, uint64_t length) {
+    for (const auto& range : ranges_) {
+        if (length == 0) {
+            break;
+        }
+        if (logical < range.logical || logical >= range.logical + range.length) {
+            continue;
+        }
+        uint64_t chunk = std::min(length, range.logical + range.length - logical);
+        if (range.zero) {
+            memset(data, 0, chunk);
+        } else if (!throttledReadAt(fd_, data, chunk, range.physical + (logical - range.logical))) {
+            std::cerr << "Read from super failed at " << range.physical + (logical - range.logical) << ": "
+                      << strerror(errno) << std::endl;
+            return false;
+        }
+        logical += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+    if (length != 0) {
+        std::cerr << "Read past the end of the partition at offset " << logical << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Copies |length| bytes between two descriptors without bouncing the data through
+// userspace where the kernel allows it: copy_file_range between regular files,
+// splice through a pipe for block devices, and a read/write loop as the last resort.
+// |zeroCopy| is cleared when the fallback had to be used.
+bool copyRange(int inFd, uint64_t inOffset, int outFd, uint64_t outOffset, uint64_t length, bool* zeroCopy) {
+    // Under a rate limit requests stay small enough for the token bucket to pace them.
+    uint64_t maxRequest = sIoThrottle.Active() ? kIoBufferSize : 1u << 30;
+    while (length > 0) {
+        loff_t in = inOffset, out = outOffset;
+        size_t request = std::min(length, maxRequest);
+        sIoThrottle.Acquire(request);
+        auto start = std::chrono::steady_clock::now();
+        ssize_t rv = syscall(__NR_copy_file_range, inFd, &in, outFd, &out, request, 0);
+        sIoThrottle.ObserveWrite(std::chrono::steady_clock::now() - start);
+        if (rv <= 0) {
+            break;
+        }
+        inOffset += rv;
+        outOffset += rv;
+        length -= rv;
+    }
+    int pipeFds[2];
+    if (length > 0 && pipe2(pipeFds, O_CLOEXEC) == 0) {
+        android::base::unique_fd pipeRead(pipeFds[0]), pipeWrite(pipeFds[1]);
+        fcntl(pipeWrite, F_SETPIPE_SZ, 1024 * 1024);
+        while (length > 0) {
+            loff_t in = inOffset, out = outOffset;
+            size_t request = std::min<uint64_t>(length, 1024 * 1024);
+            sIoThrottle.Acquire(request);
+            ssize_t spliced = splice(inFd, &in, pipeWrite, nullptr, request, SPLICE_F_MOVE);
+            if (spliced <= 0) {
+                break;
+            }
+            for (ssize_t left = spliced; left > 0;) {
+                ssize_t rv = splice(pipeRead, nullptr, outFd, &out, left, SPLICE_F_MOVE);
+                if (rv <= 0) {
+                    std::cerr << "splice failed: " << strerror(errno) << std::endl;
+                    return false;
+                }
+                left -= rv;
+            }
+            inOffset += spliced;
+            outOffset += spliced;
+            length -= spliced;
+        }
+    }
+    if (length == 0) {
+        return true;
+    }
+    *zeroCopy = false;
+    auto buffer = allocateAligned(kIoBufferSize);
+    while (buffer && length > 0) {
+        size_t n = std::min<uint64_t>(length, kIoBufferSize);
+        if (!throttledReadAt(inFd, buffer.get(), n, inOffset)) {
+            std::cerr << "Read failed at " << inOffset << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (!throttledWriteAt(outFd, buffer.get(), n, outOffset)) {
+            std::cerr << "Write failed at " << outOffset << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        inOffset += n;
+        outOffset += n;
+        length -= n;
+    }
+    return length == 0;
+}
+
+// Overlaps producing data (reading an image, expanding sparse chunks) with writing
+// it: the caller fills one buffer while a worker thread writes the previous ones.
+// Discontiguous appends start a new buffer, so skipped ranges are never written.
+class PipelinedWriter {
+public:
+    explicit PipelinedWriter(ExtentWriter* writer);
+    ~PipelinedWriter();
+
+    bool Append(uint64_t logical, const void* data, size_t length);
+    // Waits for everything appended so far to be written and makes it durable.
+    bool Sync();
+    bool Finish();
+    uint64_t bytes_written() const { return written_; }
+
+private:
+    struct Block {
+        AlignedBuffer buffer;
+        uint64_t logical = 0;
+        size_t length = 0;
+    };
+    void Flush();
+    void WorkerLoop();
+
+    ExtentWriter* writer_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<AlignedBuffer> free_;
+    std::deque<Block> queued_;
+    Block current_;
+    bool busy_ = false;
+    bool done_ = false;
+    bool failed_ = false;
+    std::atomic<uint64_t> written_{0};
+    std::thread worker_;
+};
+
+PipelinedWriter::PipelinedWriter(ExtentWriter* writer) : writer_(writer) {
+    for (size_t i = 0; i < kIoQueueDepth; i++) {
+        auto buffer = allocateAligned(kIoBufferSize);
+        if (!buffer) {
+            failed_ = true;
+            break;
+        }
+        free_.push_back(std::move(buffer));
+    }
+    worker_ = std::thread(&PipelinedWriter::WorkerLoop, this);
+}
+
+PipelinedWriter::~PipelinedWriter() {
+    if (worker_.joinable()) {
+        Finish();
+    }
+}
+
+bool PipelinedWriter::Append(uint64_t logical, const void* data, size_t length) {
+    auto src = static_cast<const uint8_t*>(data);
+    while (length > 0) {
+        if (current_.buffer && current_.logical + current_.length != logical) {
+            Flush();
+        }
+        if (!current_.buffer) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return !free_.empty() || failed_; });
+            if (failed_) {
+                return false;
+            }
+            current_.buffer = std::move(free_.front());
+            free_.pop_front();
+            current_.logical = logical;
+            current_.length = 0;
+        }
+        size_t n = std::min(length, kIoBufferSize - current_.length);
+        memcpy(current_.buffer.get() + current_.length, src, n);
+        current_.length += n;
+        logical += n;
+        src += n;
+        length -= n;
+        if (current_.length == kIoBufferSize) {
+            Flush();
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    return !failed_;
+}
+
+void PipelinedWriter::Flush() {
+    if (!current_.buffer) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    queued_.push_back(std::move(current_));
+    current_ = Block();
+    cv_.notify_all();
+}
+
+void PipelinedWriter::WorkerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this] { return !queued_.empty() || done_; });
+        if (queued_.empty()) {
+            return;
+        }
+        Block block = std::move(queued_.front());
+        queued_.pop_front();
+        bool skip = failed_;
+        busy_ = true;
+        lock.unlock();
+        bool ok = skip || writer_->Write(block.logical, block.buffer.get(), block.length);
+        lock.lock();
+        busy_ = false;
+        if (!ok) {
+            failed_ = true;
+        } else if (!skip) {
+            written_ += block.length;
+        }
+        free_.push_back(std::move(block.buffer));
+        cv_.notify_all();
+    }
+}
+
+bool PipelinedWriter::Sync() {
+    Flush();
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return (queued_.empty() && !busy_) || failed_; });
+    if (failed_) {
+        return false;
+    }
+    lock.unlock();
+    return writer_->Sync();
+}
+
+bool PipelinedWriter::Finish() {
+    Flush();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+        cv_.notify_all();
+    }
+    worker_.join();
+    return !failed_ && writer_->Sync();
+}
+
+bool MetadataIndex::Load(const string& superPath, uint32_t slot) {
+    TraceScope trace("ReadMetadata");
+    SuperPartitionOpener opener(superPath);
+    metadata_ = ReadMetadata(opener, superPath, slot);
+    if (!metadata_) {
+        return false;
+    }
+    super_path_ = superPath;
+    slot_ = slot;
+    for (const auto& partition : metadata_->partitions) {
+        partitions_.emplace(GetPartitionName(partition), &partition);
+    }
+    for (uint32_t i = 0; i < metadata_->groups.size(); i++) {
+        groups_.emplace(GetPartitionGroupName(metadata_->groups[i]), i);
+    }
+    return true;
+}
+
+const LpMetadataPartition* MetadataIndex::FindPartition(const string& name) const {
+    auto it = partitions_.find(name);
+    return it == partitions_.end() ? nullptr : it->second;
+}
+
+const LpMetadataPartitionGroup* MetadataIndex::FindGroup(const string& name) const {
+    auto it = groups_.find(name);
+    return it == groups_.end() ? nullptr : &metadata_->groups[it->second];
+}
+
+string MetadataIndex::GroupName(const LpMetadataPartition& partition) const {
+    return GetPartitionGroupName(metadata_->groups[partition.group_index]);
+}
+
+std::vector<string> MetadataIndex::ListGroups() const {
+    std::vector<string> groups;
+    for (const auto& group : metadata_->groups) {
+        groups.push_back(GetPartitionGroupName(group));
+    }
+    return groups;
+}
+
+std::vector<const LpMetadataPartition*> MetadataIndex::ListPartitionsInGroup(const string& group) const {
+    std::vector<const LpMetadataPartition*> partitions;
+    auto it = groups_.find(group);
+    if (it == groups_.end()) {
+        return partitions;
+    }
+    for (const auto& partition : metadata_->partitions) {
+        if (partition.group_index == it->second) {
+            partitions.push_back(&partition);
+        }
+    }
+    return partitions;
+}
+
+// Matches Partition::BytesOnDisk: zero extents take no space on super.
+uint64_t MetadataIndex::BytesOnDisk(const LpMetadataPartition& partition) const {
+    uint64_t sectors = 0;
+    for (uint32_t i = 0; i < partition.num_extents; i++) {
+        const auto& extent = metadata_->extents[partition.first_extent_index + i];
+        if (extent.target_type == LP_TARGET_TYPE_LINEAR) {
+            sectors += extent.num_sectors;
+        }
+    }
+    return sectors * LP_SECTOR_SIZE;
+}
+
+uint64_t MetadataIndex::AllocatableSpace() const {
+    uint64_t total = 0;
+    for (const auto& device : metadata_->block_devices) {
+        total += device.size - device.first_logical_sector * LP_SECTOR_SIZE;
+    }
+    return total;
+}
+
+uint64_t MetadataIndex::UsedSpace() const {
+    uint64_t used = 0;
+    for (const auto& partition : metadata_->partitions) {
+        used += BytesOnDisk(partition);
+    }
+    return used;
+}
+
+// Free space of a group as --free reports it: bounded by both the group limit and
+// what is left on super.
+uint64_t groupFreeSpace(const MetadataIndex& index, const string& groupName) {
+    uint64_t superFreeSpace = index.AllocatableSpace() - index.UsedSpace();
+    auto group = index.FindGroup(groupName);
+    if (group == nullptr || group->maximum_size == 0) {
+        return superFreeSpace;
+    }
+    uint64_t used = 0;
+    for (const auto& partition : index.ListPartitionsInGroup(groupName)) {
+        used += index.BytesOnDisk(*partition);
+    }
+    uint64_t groupAllocatable = group->maximum_size > used ? group->maximum_size - used : 0;
+    return std::min(groupAllocatable, superFreeSpace);
+}
+
+bool getPartitionRanges(const LpMetadata& metadata, const LpMetadataPartition& partition,
+                        std::vector<PartitionRange>* ranges) {
+    uint64_t logical = 0;
+    for (uint32_t i = 0; i < partition.num_extents; i++) {
+        const auto& extent = metadata.extents[partition.first_extent_index + i];
+        PartitionRange range = {logical, 0, extent.num_sectors * LP_SECTOR_SIZE, true};
+        if (extent.target_type == LP_TARGET_TYPE_LINEAR) {
+            if (extent.target_source != 0) {
+                std::cerr << "Partition " << GetPartitionName(partition) << " has extents outside of super, which is not supported" << std::endl;
+                return false;
+            }
+            range.physical = extent.target_data * LP_SECTOR_SIZE;
+            range.zero = false;
+        }
+        ranges->push_back(range);
+        logical += range.length;
+    }
+    return true;
+}
+
+// Unallocated sectors of super as [start, end) pairs in ascending order.
+std::vector<std::pair<uint64_t, uint64_t>> superFreeRegions(const LpMetadata& metadata) {
+    std::vector<std::pair<uint64_t, uint64_t>> used;
+    for (const auto& extent : metadata.extents) {
+        if (extent.target_type == LP_TARGET_TYPE_LINEAR && extent.target_source == 0) {
+            used.emplace_back(extent.target_data, extent.target_data + extent.num_sectors);
+        }
+    }
+    std::sort(used.begin(), used.end());
+    const auto& super = metadata.block_devices[0];
+    std::vector<std::pair<uint64_t, uint64_t>> free;
+    uint64_t cursor = super.first_logical_sector;
+    for (const auto& [start, end] : used) {
+        if (start > cursor) {
+            free.emplace_back(cursor, start);
+        }
+        cursor = std::max(cursor, end);
+    }
+    if (cursor < super.size / LP_SECTOR_SIZE) {
+        free.emplace_back(cursor, super.size / LP_SECTOR_SIZE);
+    }
+    return free;
+}
+
+// The share of free space outside the largest free region: 0 when it is all in one
+// piece, close to 1 when it is scattered over many small gaps.
+double fragmentationScore(const std::vector<std::pair<uint64_t, uint64_t>>& free) {
+    uint64_t total = 0, largest = 0;
+    for (const auto& [start, end] : free) {
+        total += end - start;
+        largest = std::max(largest, end - start);
+    }
+    return total > 0 ? 1.0 - double(largest) / total : 0.0;
+}
+
+string jsonString(const string& value) {
+    string out = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out += android::base::StringPrintf("\\u%04x", c);
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+// Prints the layout of super as a single JSON document. With |onlyGroup| set, only
+// that group is listed (used by --free --json).
+void printJsonInfo(const MetadataIndex& index, const string& onlyGroup, int slotValue,
+                   const string& suffixValue, const string& superPath, const string& groupValue) {
+    const auto& metadata = index.metadata();
+    auto& dm = android::dm::DeviceMapper::Instance();
+    bool useDm = isBlockDevice(superPath);
+    uint64_t allocatable = index.AllocatableSpace();
+    uint64_t used = index.UsedSpace();
+    printf("{\n  \"slot\": %d,\n  \"suffix\": %s,\n  \"super\": %s,\n  \"group\": %s,\n", slotValue,
+           jsonString(suffixValue).c_str(), jsonString(superPath).c_str(), jsonString(groupValue).c_str());
+    printf("  \"allocatable_bytes\": %" PRIu64 ",\n  \"used_bytes\": %" PRIu64 ",\n  \"free_bytes\": %" PRIu64 ",\n",
+           allocatable, used, allocatable - used);
+    printf("  \"block_devices\": [");
+    for (size_t i = 0; i < metadata.block_devices.size(); i++) {
+        const auto& device = metadata.block_devices[i];
+        printf("%s\n    {\"name\": %s, \"size\": %" PRIu64 ", \"first_logical_sector\": %" PRIu64 ", \"alignment\": %u}",
+               i ? "," : "", jsonString(GetBlockDevicePartitionName(device)).c_str(), device.size,
+               device.first_logical_sector, device.alignment);
+    }
+    auto free = superFreeRegions(metadata);
+    printf("\n  ],\n  \"free_regions\": [");
+    for (size_t i = 0; i < free.size(); i++) {
+        printf("%s\n    {\"offset\": %" PRIu64 ", \"size\": %" PRIu64 "}", i ? "," : "",
+               free[i].first * LP_SECTOR_SIZE, (free[i].second - free[i].first) * LP_SECTOR_SIZE);
+    }
+    printf("\n  ],\n  \"fragmentation\": %.3f,\n  \"groups\": [", fragmentationScore(free));
+    bool firstGroup = true;
+    for (const auto& groupName : index.ListGroups()) {
+        if (!onlyGroup.empty() && groupName != onlyGroup) {
+            continue;
+        }
+        auto group = index.FindGroup(groupName);
+        auto partitions = index.ListPartitionsInGroup(groupName);
+        uint64_t groupUsed = 0;
+        for (const auto& partition : partitions) {
+            groupUsed += index.BytesOnDisk(*partition);
+        }
+        printf("%s\n    {\n      \"name\": %s,\n      \"maximum_size\": %" PRIu64 ",\n      \"used_bytes\": %" PRIu64
+               ",\n      \"free_bytes\": %" PRIu64 ",\n      \"partitions\": [",
+               firstGroup ? "" : ",", jsonString(groupName).c_str(), group->maximum_size, groupUsed,
+               groupFreeSpace(index, groupName));
+        firstGroup = false;
+        for (size_t p = 0; p < partitions.size(); p++) {
+            const auto& partition = *partitions[p];
+            auto name = GetPartitionName(partition);
+            std::vector<string> attributes;
+            if (partition.attributes & LP_PARTITION_ATTR_READONLY) attributes.push_back("\"readonly\"");
+            if (partition.attributes & LP_PARTITION_ATTR_SLOT_SUFFIXED) attributes.push_back("\"slot-suffixed\"");
+            if (partition.attributes & LP_PARTITION_ATTR_UPDATED) attributes.push_back("\"updated\"");
+            if (partition.attributes & LP_PARTITION_ATTR_DISABLED) attributes.push_back("\"disabled\"");
+            uint64_t size = 0;
+            string extents;
+            for (uint32_t e = 0; e < partition.num_extents; e++) {
+                const auto& extent = metadata.extents[partition.first_extent_index + e];
+                size += extent.num_sectors * LP_SECTOR_SIZE;
+                if (e) extents += ", ";
+                if (extent.target_type == LP_TARGET_TYPE_LINEAR) {
+                    extents += android::base::StringPrintf(
+                            "{\"type\": \"linear\", \"num_sectors\": %" PRIu64 ", \"physical_sector\": %" PRIu64
+                            ", \"block_device\": %u}",
+                            extent.num_sectors, extent.target_data, extent.target_source);
+                } else {
+                    extents += android::base::StringPrintf("{\"type\": \"zero\", \"num_sectors\": %" PRIu64 "}",
+                                                           extent.num_sectors);
+                }
+            }
+            // On an image file a device of the same name belongs to another super.
+            auto state = useDm ? dm.GetState(name) : android::dm::DmDeviceState::INVALID;
+            string dmPath;
+            if (state != android::dm::DmDeviceState::INVALID) {
+                dm.GetDmDevicePathByName(name, &dmPath);
+            }
+            printf("%s\n        {\"name\": %s, \"size\": %" PRIu64 ", \"bytes_on_disk\": %" PRIu64
+                   ", \"attributes\": [%s], \"extents\": [%s], \"dm_state\": %s, \"dm_path\": %s}",
+                   p ? "," : "", jsonString(name).c_str(), size, index.BytesOnDisk(partition),
+                   android::base::Join(attributes, ", ").c_str(), extents.c_str(),
+                   state == android::dm::DmDeviceState::ACTIVE      ? "\"active\""
+                   : state == android::dm::DmDeviceState::SUSPENDED ? "\"suspended\""
+                                                                    : "null",
+                   dmPath.empty() ? "null" : jsonString(dmPath).c_str());
+        }
+        printf("\n      ]\n    }");
+    }
+    printf("\n  ]\n}\n");
+}
+
+// The whitespace-separated words of one line of a --batch file or --make-super
+// manifest, with anything after a '#' dropped.
+std::vector<string> splitLine(string line) {
+    auto comment = line.find('#');
+    if (comment != string::npos) {
+        line.erase(comment);
+    }
+    std::vector<string> words;
+    for (const auto& token : android::base::Split(line, " \t\r")) {
+        if (!token.empty()) {
+            words.push_back(token);
+        }
+    }
+    return words;
+}
+
+// One line of a --batch file: the command without its leading "--" and its arguments.
+struct BatchOperation {
+    size_t line;
+    std::vector<string> args;
+};
+
+bool readBatchFile(const string& path, std::vector<BatchOperation>* operations) {
+    std::ifstream file;
+    std::istream* input = &std::cin;
+    if (path != "-") {
+        file.open(path);
+        if (!file.good()) {
+            std::cerr << "Error: Unable to open batch file: " << path << std::endl;
+            return false;
+        }
+        input = &file;
+    }
+    string line;
+    for (size_t lineNumber = 1; std::getline(*input, line); lineNumber++) {
+        auto args = splitLine(line);
+        if (args.empty()) {
+            continue;
+        }
+        if (args[0].compare(0, 2, "--") == 0) {
+            args[0].erase(0, 2);
+        }
+        size_t expected;
+        if (args[0] == "create" || args[0] == "resize") {
+            expected = 3;
+        } else if (args[0] == "remove" || args[0] == "map" || args[0] == "unmap" || args[0] == "group") {
+            expected = 2;
+        } else if (args[0] == "unlimited-group") {
+            expected = 1;
+        } else {
+            std::cerr << "Error: line " << lineNumber << ": unsupported batch command '" << args[0] << "'" << std::endl;
+            return false;
+        }
+        if (args.size() != expected) {
+            std::cerr << "Error: line " << lineNumber << ": '" << args[0] << "' expects " << expected - 1 << " argument(s)" << std::endl;
+            return false;
+        }
+        operations->push_back({lineNumber, std::move(args)});
+    }
+    return true;
+}
+
+// Applies every operation to one in-memory builder and commits the result with a
+// single metadata write. Nothing is written if any operation fails, but |builder| is
+// left with the operations before the failing one applied. |committed|, if given, is
+// set once the tables are written, even if mapping afterwards fails.
+int applyBatch(PartitionBuilder& builder, const std::vector<BatchOperation>& operations, string groupValue,
+               const string& superPath, int slotValue, bool* committed = nullptr) {
+    if (committed != nullptr) {
+        *committed = false;
+    }
+    // dm devices can only be built on a block device, not on an image file or the
+    // memfd standing in for a sparse image.
+    bool useDm = isBlockDevice(superPath);
+    // Partitions to map after the commit, in the order they were first mentioned.
+    std::vector<string> toMap;
+    std::vector<string> toUnmap;
+    std::vector<string> resized;
+    auto addUnique = [](std::vector<string>& list, const string& name) {
+        if (std::find(list.begin(), list.end(), name) == list.end()) {
+            list.push_back(name);
+        }
+    };
+    auto eraseName = [](std::vector<string>& list, const string& name) {
+        list.erase(std::remove(list.begin(), list.end(), name), list.end());
+    };
+
+    for (const auto& op : operations) {
+        const auto& cmd = op.args[0];
+        TraceScope trace("BatchOperation", android::base::StringPrintf("line %zu: %s", op.line, cmd.c_str()));
+        auto fail = [&](const string& message) {
+            std::cerr << "Error: line " << op.line << " (" << cmd << "): " << message << std::endl;
+            std::cerr << "Batch aborted, nothing was written" << std::endl;
+            return 1;
+        };
+        if (cmd == "group") {
+            if (builder->FindGroup(op.args[1]) == nullptr) {
+                return fail("group '" + op.args[1] + "' does not exist");
+            }
+            groupValue = op.args[1];
+        } else if (cmd == "create") {
+            uint64_t partitionSize;
+            if (!parseSize(op.args[2], &partitionSize)) {
+                return fail("invalid size " + op.args[2]);
+            }
+            if (builder->FindPartition(op.args[1]) != nullptr) {
+                return fail("partition " + op.args[1] + " already exists");
+            }
+            auto partition = builder->AddPartition(op.args[1], groupValue, 0);
+            if (partition == nullptr) {
+                return fail("failed to add partition " + op.args[1]);
+            }
+            if (!builder->ResizePartition(partition, partitionSize)) {
+                return fail("not enough space to create " + op.args[1]);
+            }
+            addUnique(toMap, op.args[1]);
+        } else if (cmd == "remove") {
+            if (builder->FindPartition(op.args[1]) == nullptr) {
+                return fail("partition " + op.args[1] + " does not exist");
+            }
+            builder->RemovePartition(op.args[1]);
+            eraseName(toMap, op.args[1]);
+            eraseName(resized, op.args[1]);
+            addUnique(toUnmap, op.args[1]);
+        } else if (cmd == "resize") {
+            uint64_t partitionSize;
+            if (!parseSize(op.args[2], &partitionSize)) {
+                return fail("invalid size " + op.args[2]);
+            }
+            auto partition = builder->FindPartition(op.args[1]);
+            if (partition == nullptr) {
+                return fail("partition " + op.args[1] + " does not exist");
+            }
+            if (!builder->ResizePartition(partition, partitionSize)) {
+                return fail("not enough space to resize " + op.args[1]);
+            }
+            addUnique(resized, op.args[1]);
+        } else if (cmd == "unlimited-group") {
+            if (!builder->ChangeGroupSize(groupValue, 0)) {
+                return fail("unable to change size of group " + groupValue);
+            }
+        } else if ((cmd == "map" || cmd == "unmap") && !useDm) {
+            return fail(superPath + " is not a block device, partitions cannot be mapped");
+        } else if (cmd == "map") {
+            if (builder->FindPartition(op.args[1]) == nullptr) {
+                return fail("partition " + op.args[1] + " does not exist");
+            }
+            eraseName(toUnmap, op.args[1]);
+            addUnique(toMap, op.args[1]);
+        } else if (cmd == "unmap") {
+            eraseName(toMap, op.args[1]);
+            addUnique(toUnmap, op.args[1]);
+        }
+        std::cout << "Batch line " << op.line << ": " << android::base::Join(op.args, ' ') << std::endl;
+    }
+
+    auto metadata = exportMetadata(builder);
+    if (!metadata) {
+        std::cerr << "Error: Final layout is invalid, nothing was written" << std::endl;
+        return 1;
+    }
+
+    if (!UpdateAllPartitionMetadata(superPath, *metadata.get(), slotValue)) {
+        std::cerr << "Failed to write partition table" << std::endl;
+        return 1;
+    }
+    std::cout << "Batch committed: " << operations.size() << " operation(s)" << std::endl;
+    if (committed != nullptr) {
+        *committed = true;
+    }
+    if (!useDm) {
+        return 0;
+    }
+
+    // Devices are only torn down once the tables no longer need them, so a failed
+    // write leaves every mapping as it was.
+    bool ok = true;
+    for (const auto& partName : toUnmap) {
+        if (!isMapped(partName)) {
+            continue;
+        }
+        if (!destroyLogicalPartition(partName)) {
+            std::cerr << "Unable to unmap " << partName << std::endl;
+            ok = false;
+            continue;
+        }
+        std::cout << "Unmapped " << partName << std::endl;
+    }
+
+    // Resized devices that are still mapped pick up their new extents in place.
+    reloadMappedPartitions(*metadata.get(), superPath, resized, &toMap);
+
+    std::vector<MapResult> mapped;
+    ok &= mapPartitions(*metadata.get(), superPath, toMap, &mapped);
+    for (const auto& result : mapped) {
+        if (!result.ok) {
+            std::cerr << "Could not map partition: " << result.name << std::endl;
+            continue;
+        }
+        std::cout << "Mapped " << result.name << " at " << result.path << std::endl;
+    }
+    return ok ? 0 : 1;
+}
+
+int runBatch(PartitionBuilder& builder, const string& batchPath, string groupValue,
+             const string& superPath, int slotValue) {
+    std::vector<BatchOperation> operations;
+    if (!readBatchFile(batchPath, &operations)) {
+        return 1;
+    }
+    return applyBatch(builder, operations, groupValue, superPath, slotValue);
+}
+
+struct SparseFlashContext {
+    PipelinedWriter* writer;
+    uint64_t offset;
+    uint64_t skipped;
+};
+
+// sparse_file_callback hands us the expanded image in order; DONT_CARE chunks
+// arrive with a null |data| and are skipped without touching the disk.
+int sparseFlashCallback(void* priv, const void* data, size_t len) {
+    auto ctx = static_cast<SparseFlashContext*>(priv);
+    if (data == nullptr) {
+        ctx->skipped += len;
+    } else if (!ctx->writer->Append(ctx->offset, data, len)) {
+        return -1;
+    }
+    ctx->offset += len;
+    return 0;
+}
+
+// Streams a raw or Android sparse image straight into the extents of |partName| on
+// super. With |autoResize| the image goes to the extents of the resized partition and
+// the new tables are only written once it is on disk, as --clone does, so a failed
+// flash never leaves the partition resized.
+int flashPartition(PartitionBuilder& builder, const string& superPath, int slotValue,
+                   const string& partName, const string& imagePath, bool autoResize) {
+    auto partition = builder->FindPartition(partName);
+    if (partition == nullptr) {
+        std::cerr << "Partition does not exist" << std::endl;
+        return 1;
+    }
+    android::base::unique_fd imageFd(open(imagePath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (imageFd < 0) {
+        std::cerr << "Unable to open " << imagePath << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    uint32_t magic = 0;
+    std::unique_ptr<sparse_file, decltype(&sparse_file_destroy)> sparse(nullptr, sparse_file_destroy);
+    uint64_t imageSize;
+    if (pread(imageFd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == SPARSE_HEADER_MAGIC) {
+        sparse.reset(sparse_file_import(imageFd, false, false));
+        if (!sparse) {
+            std::cerr << "Unable to parse sparse image " << imagePath << std::endl;
+            return 1;
+        }
+        imageSize = sparse_file_len(sparse.get(), false, false);
+    } else {
+        struct stat st;
+        if (fstat(imageFd, &st) != 0) {
+            std::cerr << "Unable to stat " << imagePath << ": " << strerror(errno) << std::endl;
+            return 1;
+        }
+        imageSize = st.st_size;
+        posix_fadvise(imageFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    std::unique_ptr<LpMetadata> resizedMetadata;
+    if (autoResize && imageSize != partition->size()) {
+        bool resized;
+        {
+            TraceScope trace("ResizePartition", partName);
+            resized = builder->ResizePartition(partition, imageSize);
+        }
+        if (!resized) {
+            std::cerr << "Not enough space to resize partition" << std::endl;
+            return 1;
+        }
+        resizedMetadata = exportMetadata(builder);
+        if (!resizedMetadata) {
+            std::cerr << "Failed to export metadata" << std::endl;
+            return 1;
+        }
+    } else if (imageSize > partition->size()) {
+        std::cerr << "Image is larger than the partition (" << imageSize << " > " << partition->size()
+                  << "), use --auto-resize" << std::endl;
+        return 1;
+    }
+
+    std::vector<PartitionRange> ranges;
+    ExtentWriter extentWriter;
+    if (!getPartitionRanges(partition, &ranges) || !extentWriter.Open(superPath, std::move(ranges))) {
+        return 1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    PipelinedWriter writer(&extentWriter);
+    uint64_t skipped = 0;
+    bool ok = true;
+    if (sparse) {
+        SparseFlashContext ctx = {&writer, 0, 0};
+        ok = sparse_file_callback(sparse.get(), false, false, sparseFlashCallback, &ctx) == 0;
+        skipped = ctx.skipped;
+    } else {
+        auto buffer = allocateAligned(kIoBufferSize);
+        for (uint64_t offset = 0; ok && buffer && offset < imageSize;) {
+            ssize_t rv = TEMP_FAILURE_RETRY(read(imageFd, buffer.get(), kIoBufferSize));
+            if (rv == 0) {
+                std::cerr << imagePath << " ended after " << offset << " of " << imageSize << " bytes" << std::endl;
+                ok = false;
+                break;
+            }
+            if (rv < 0) {
+                std::cerr << "Read from " << imagePath << " failed: " << strerror(errno) << std::endl;
+                ok = false;
+                break;
+            }
+            ok = writer.Append(offset, buffer.get(), rv);
+            offset += rv;
+        }
+        ok &= !!buffer;
+    }
+    ok &= writer.Finish();
+    if (!ok) {
+        std::cerr << "Failed to flash " << partName << (resizedMetadata ? ", the partition table is unchanged" : "")
+                  << std::endl;
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Flashed %s: %" PRIu64 " bytes written, %" PRIu64 " bytes skipped, %.2f s, %.2f MB/s\n",
+           partName.c_str(), writer.bytes_written(), skipped, seconds,
+           seconds > 0 ? writer.bytes_written() / 1024.0 / 1024.0 / seconds : 0.0);
+    if (!resizedMetadata) {
+        return 0;
+    }
+    if (!UpdateAllPartitionMetadata(superPath, *resizedMetadata.get(), slotValue)) {
+        std::cerr << "Failed to write partition table" << std::endl;
+        return 1;
+    }
+    std::cout << "Resized " << partName << " to " << partition->size() << std::endl;
+    if (isBlockDevice(superPath)) {
+        std::vector<string> toMap;
+        reloadMappedPartitions(*resizedMetadata.get(), superPath, {partName}, &toMap);
+        std::vector<MapResult> results;
+        mapPartitions(*resizedMetadata.get(), superPath, toMap, &results);
+    }
+    return 0;
+}
+
+static constexpr uint32_t kSparseBlockSize = 4096;
+
+// Returns true if |block| is one 32-bit value repeated. The OR-reduction over 64-bit
+// words has no early exit so the compiler turns it into a vector loop.
+bool isFillBlock(const uint8_t* block, uint32_t* fill) {
+    uint32_t value;
+    memcpy(&value, block, sizeof(value));
+    uint64_t pattern = (uint64_t(value) << 32) | value;
+    auto words = reinterpret_cast<const uint64_t*>(block);
+    uint64_t diff = 0;
+    for (size_t i = 0; i < kSparseBlockSize / sizeof(uint64_t); i++) {
+        diff |= words[i] ^ pattern;
+    }
+    *fill = value;
+    return diff == 0;
+}
+
+// Builds a sparse image of the partition. Fill and all-zero blocks become FILL
+// chunks, zero extents become zero FILL chunks without being read, and data runs
+// are added as references to super so they are only read again while writing.
+bool dumpSparse(ExtentReader& reader, uint64_t size, int outFd, uint64_t* bytesRead) {
+    std::unique_ptr<sparse_file, decltype(&sparse_file_destroy)> sparse(
+            sparse_file_new(kSparseBlockSize, size), sparse_file_destroy);
+    auto buffer = allocateAligned(kIoBufferSize);
+    if (!sparse || !buffer) {
+        std::cerr << "Unable to allocate sparse image" << std::endl;
+        return false;
+    }
+    for (const auto& range : reader.ranges()) {
+        if (range.logical % kSparseBlockSize != 0 || range.length % kSparseBlockSize != 0) {
+            std::cerr << "Extents are not aligned to " << kSparseBlockSize << " bytes, use a raw dump" << std::endl;
+            return false;
+        }
+        unsigned int firstBlock = range.logical / kSparseBlockSize;
+        if (range.zero) {
+            sparse_file_add_fill(sparse.get(), 0, range.length, firstBlock);
+            continue;
+        }
+        // A run of consecutive blocks of the same kind, flushed when the kind changes.
+        bool runIsFill = false;
+        uint32_t runFill = 0;
+        uint64_t runStart = 0, runLength = 0;
+        auto flushRun = [&]() {
+            if (runLength == 0) {
+                return;
+            }
+            unsigned int block = (range.logical + runStart) / kSparseBlockSize;
+            if (runIsFill) {
+                sparse_file_add_fill(sparse.get(), runFill, runLength, block);
+            } else {
+                sparse_file_add_fd(sparse.get(), reader.fd(), range.physical + runStart, runLength, block);
+            }
+            runLength = 0;
+        };
+        for (uint64_t offset = 0; offset < range.length;) {
+            size_t n = std::min<uint64_t>(kIoBufferSize, range.length - offset);
+            if (!reader.Read(range.logical + offset, buffer.get(), n)) {
+                return false;
+            }
+            *bytesRead += n;
+            for (size_t pos = 0; pos < n; pos += kSparseBlockSize) {
+                uint32_t fill;
+                bool isFill = isFillBlock(buffer.get() + pos, &fill);
+                if (runLength == 0 || isFill != runIsFill || (isFill && fill != runFill)) {
+                    flushRun();
+                    runIsFill = isFill;
+                    runFill = fill;
+                    runStart = offset + pos;
+                }
+                runLength += kSparseBlockSize;
+            }
+            offset += n;
+        }
+        flushRun();
+    }
+    if (sparse_file_write(sparse.get(), outFd, false, true, false) != 0) {
+        std::cerr << "Unable to write sparse image" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Extracts |partName| from super into |outPath| without mapping it. Raw dumps leave
+// zero extents as holes in the output file.
+int dumpPartition(const MetadataIndex& index, const string& superPath, const string& partName,
+                  const string& outPath, bool sparseOutput) {
+    auto partition = index.FindPartition(partName);
+    if (partition == nullptr) {
+        std::cerr << "Partition does not exist" << std::endl;
+        return 1;
+    }
+    std::vector<PartitionRange> ranges;
+    ExtentReader reader;
+    if (!getPartitionRanges(index.metadata(), *partition, &ranges) || !reader.Open(superPath, std::move(ranges))) {
+        return 1;
+    }
+    uint64_t partitionSize = 0;
+    for (const auto& range : reader.ranges()) {
+        partitionSize += range.length;
+    }
+    android::base::unique_fd outFd(open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (outFd < 0) {
+        std::cerr << "Unable to open " << outPath << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t bytesRead = 0, holes = 0;
+    bool zeroCopy = true;
+    bool ok;
+    if (sparseOutput) {
+        ok = dumpSparse(reader, partitionSize, outFd, &bytesRead);
+    } else {
+        ok = ftruncate(outFd, partitionSize) == 0;
+        for (const auto& range : reader.ranges()) {
+            if (!ok) {
+                break;
+            }
+            if (range.zero) {
+                holes += range.length;
+                continue;
+            }
+            ok = copyRange(reader.fd(), range.physical, outFd, range.logical, range.length, &zeroCopy);
+            bytesRead += range.length;
+        }
+    }
+    ok = ok && fsync(outFd) == 0;
+    if (!ok) {
+        std::cerr << "Failed to dump " << partName << std::endl;
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Dumped %s to %s: %" PRIu64 " bytes read, %" PRIu64 " bytes of holes, %s, %.2f s, %.2f MB/s\n",
+           partName.c_str(), outPath.c_str(), bytesRead, holes,
+           sparseOutput ? "sparse" : (zeroCopy ? "zero-copy" : "buffered copy"), seconds,
+           seconds > 0 ? bytesRead / 1024.0 / 1024.0 / seconds : 0.0);
+    return 0;
+}
+
+static constexpr uint64_t kHashChunkSize = 4 * 1024 * 1024;
+// Every worker holds a buffer of one chunk, so a hash file may not ask for more.
+static constexpr uint64_t kMaxHashChunkSize = 256 * 1024 * 1024;
+static constexpr const char* kHashFileMagic = "# lptools hash";
+using Sha256 = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
+
+string toHex(const uint8_t* data, size_t length) {
+    static const char kDigits[] = "0123456789abcdef";
+    string hex;
+    for (size_t i = 0; i < length; i++) {
+        hex += kDigits[data[i] >> 4];
+        hex += kDigits[data[i] & 0xf];
+    }
+    return hex;
+}
+
+// The top hash of --hash: SHA-256 over the chunk hashes in order, so chunks can be
+// hashed in parallel. It is not the sha256sum of the partition.
+Sha256 rootHash(const std::vector<Sha256>& chunks) {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    for (const auto& chunk : chunks) {
+        SHA256_Update(&ctx, chunk.data(), chunk.size());
+    }
+    Sha256 root;
+    SHA256_Final(root.data(), &ctx);
+    return root;
+}
+
+bool isZeroRange(const std::vector<PartitionRange>& ranges, uint64_t logical, uint64_t length) {
+    for (const auto& range : ranges) {
+        if (logical >= range.logical && logical + length <= range.logical + range.length) {
+            return range.zero;
+        }
+    }
+    return false;
+}
+
+size_t hardwareWorkers() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Hashes every |chunkSize| piece of the partition on all cores. With |expected|, a
+// chunk whose hash differs is recorded in |firstMismatch| and later chunks are
+// skipped; chunks before it are always finished, so the lowest mismatch wins.
+bool hashPartitionChunks(ExtentReader& reader, uint64_t size, uint64_t chunkSize, std::vector<Sha256>* hashes,
+                         const std::vector<Sha256>* expected, std::atomic<size_t>* firstMismatch) {
+    size_t count = (size + chunkSize - 1) / chunkSize;
+    hashes->assign(count, Sha256());
+    Sha256 zeroHash;
+    {
+        std::vector<uint8_t> zeroes(chunkSize);
+        SHA256(zeroes.data(), zeroes.size(), zeroHash.data());
+    }
+    std::atomic<bool> ok{true};
+    parallelFor(count, hardwareWorkers(), [&](size_t i) {
+        if (!ok || (firstMismatch != nullptr && i > *firstMismatch)) {
+            return;
+        }
+        thread_local AlignedBuffer buffer;
+        thread_local uint64_t bufferSize = 0;
+        uint64_t logical = i * chunkSize;
+        uint64_t length = std::min(chunkSize, size - logical);
+        if (length == chunkSize && isZeroRange(reader.ranges(), logical, length)) {
+            (*hashes)[i] = zeroHash;
+        } else {
+            if (bufferSize < chunkSize) {
+                buffer = allocateAligned(chunkSize);
+                bufferSize = buffer ? chunkSize : 0;
+            }
+            if (!buffer || !reader.Read(logical, buffer.get(), length)) {
+                ok = false;
+                return;
+            }
+            SHA256(buffer.get(), length, (*hashes)[i].data());
+        }
+        if (expected != nullptr && (*hashes)[i] != (*expected)[i]) {
+            for (size_t prev = *firstMismatch; i < prev && !firstMismatch->compare_exchange_weak(prev, i);) {
+            }
+        }
+    });
+    return ok;
+}
+
+bool openPartitionReader(const MetadataIndex& index, const string& superPath, const string& partName,
+                         ExtentReader* reader, uint64_t* size) {
+    auto partition = index.FindPartition(partName);
+    if (partition == nullptr) {
+        std::cerr << "Partition " << partName << " does not exist" << std::endl;
+        return false;
+    }
+    std::vector<PartitionRange> ranges;
+    if (!getPartitionRanges(index.metadata(), *partition, &ranges) || !reader->Open(superPath, std::move(ranges))) {
+        return false;
+    }
+    *size = 0;
+    for (const auto& range : reader->ranges()) {
+        *size += range.length;
+    }
+    return true;
+}
+
+void printHashRate(const char* what, uint64_t bytes, std::chrono::steady_clock::time_point start) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "%s %" PRIu64 " bytes on %zu threads, %.2f s, %.2f MB/s\n", what, bytes, hardwareWorkers(), seconds,
+            seconds > 0 ? bytes / 1024.0 / 1024.0 / seconds : 0.0);
+}
+
+int hashPartition(const MetadataIndex& index, const string& superPath, const string& partName, bool listChunks) {
+    ExtentReader reader;
+    uint64_t size;
+    if (!openPartitionReader(index, superPath, partName, &reader, &size)) {
+        return 1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Sha256> hashes;
+    if (!hashPartitionChunks(reader, size, kHashChunkSize, &hashes, nullptr, nullptr)) {
+        std::cerr << "Failed to hash " << partName << std::endl;
+        return 1;
+    }
+    auto root = rootHash(hashes);
+    if (listChunks) {
+        // Also the format --verify reads back.
+        printf("%s\npartition %s\nsize %" PRIu64 "\nchunk-size %" PRIu64 "\nroot %s\n", kHashFileMagic,
+               partName.c_str(), size, kHashChunkSize, toHex(root.data(), root.size()).c_str());
+        for (size_t i = 0; i < hashes.size(); i++) {
+            printf("%" PRIu64 " %s\n", i * kHashChunkSize, toHex(hashes[i].data(), hashes[i].size()).c_str());
+        }
+    } else {
+        printf("%s  %s\n", toHex(root.data(), root.size()).c_str(), partName.c_str());
+    }
+    printHashRate("Hashed", size, start);
+    return 0;
+}
+
+struct HashFile {
+    uint64_t size = 0;
+    uint64_t chunkSize = 0;
+    std::vector<Sha256> chunks;
+};
+
+bool parseHex(const string& hex, Sha256* out) {
+    if (hex.size() != out->size() * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < out->size(); i++) {
+        unsigned value;
+        if (sscanf(hex.c_str() + i * 2, "%2x", &value) != 1) {
+            return false;
+        }
+        (*out)[i] = value;
+    }
+    return true;
+}
+
+// Reads a `--hash --chunks` listing. Anything before the magic line (such as the
+// header lptools prints) is skipped. Returns false if |path| is not a hash file.
+bool readHashFile(const string& path, HashFile* file) {
+    std::ifstream in(path);
+    string line;
+    while (std::getline(in, line) && line != kHashFileMagic) {
+    }
+    if (!in) {
+        return false;
+    }
+    while (std::getline(in, line)) {
+        auto fields = android::base::Split(line, " ");
+        if (fields.size() != 2) {
+            continue;
+        }
+        uint64_t offset;
+        Sha256 hash;
+        if (fields[0] == "size") {
+            parseSize(fields[1], &file->size);
+        } else if (fields[0] == "chunk-size") {
+            parseSize(fields[1], &file->chunkSize);
+        } else if (parseSize(fields[0], &offset) && parseHex(fields[1], &hash)) {
+            if (file->chunkSize == 0 || offset != file->chunks.size() * file->chunkSize) {
+                return false;
+            }
+            file->chunks.push_back(hash);
+        }
+    }
+    return file->chunkSize != 0 && file->chunks.size() == (file->size + file->chunkSize - 1) / file->chunkSize;
+}
+
+// Compares the partition with a raw image chunk by chunk on all cores and returns
+// the offset of the first differing byte, or UINT64_MAX if the image matches.
+bool compareWithImage(ExtentReader& reader, int imageFd, uint64_t imageSize, uint64_t* mismatch) {
+    size_t count = (imageSize + kHashChunkSize - 1) / kHashChunkSize;
+    std::atomic<uint64_t> first{UINT64_MAX};
+    std::atomic<bool> ok{true};
+    parallelFor(count, hardwareWorkers(), [&](size_t i) {
+        uint64_t logical = i * kHashChunkSize;
+        if (!ok || logical > first) {
+            return;
+        }
+        thread_local AlignedBuffer partitionData = allocateAligned(kHashChunkSize);
+        thread_local AlignedBuffer imageData = allocateAligned(kHashChunkSize);
+        uint64_t length = std::min(kHashChunkSize, imageSize - logical);
+        if (!partitionData || !imageData || !reader.Read(logical, partitionData.get(), length) ||
+            !android::base::ReadFullyAtOffset(imageFd, imageData.get(), length, logical)) {
+            ok = false;
+            return;
+        }
+        if (memcmp(partitionData.get(), imageData.get(), length) != 0) {
+            uint64_t at = logical;
+            while (partitionData[at - logical] == imageData[at - logical]) {
+                at++;
+            }
+            for (uint64_t prev = first; at < prev && !first.compare_exchange_weak(prev, at);) {
+            }
+        }
+    });
+    *mismatch = first;
+    return ok;
+}
+
+int verifyPartition(const MetadataIndex& index, const string& superPath, const string& partName,
+                    const string& referencePath) {
+    ExtentReader reader;
+    uint64_t size;
+    if (!openPartitionReader(index, superPath, partName, &reader, &size)) {
+        return 1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    HashFile hashFile;
+    if (readHashFile(referencePath, &hashFile)) {
+        if (hashFile.size != size) {
+            std::cerr << "Mismatch: " << partName << " is " << size << " bytes, the hash file lists "
+                      << hashFile.size << std::endl;
+            return 1;
+        }
+        if (hashFile.chunkSize == 0 || hashFile.chunkSize % kDirectIoAlignment != 0 ||
+            hashFile.chunkSize > kMaxHashChunkSize) {
+            std::cerr << "Invalid chunk size " << hashFile.chunkSize << " in " << referencePath << ", expected a multiple of "
+                      << kDirectIoAlignment << " up to " << kMaxHashChunkSize << " bytes" << std::endl;
+            return 1;
+        }
+        std::vector<Sha256> hashes;
+        std::atomic<size_t> firstMismatch{SIZE_MAX};
+        if (!hashPartitionChunks(reader, size, hashFile.chunkSize, &hashes, &hashFile.chunks, &firstMismatch)) {
+            std::cerr << "Failed to hash " << partName << std::endl;
+            return 1;
+        }
+        if (firstMismatch != SIZE_MAX) {
+            uint64_t offset = firstMismatch * hashFile.chunkSize;
+            std::cerr << "Mismatch: chunk at offset " << offset << " (" << std::min(hashFile.chunkSize, size - offset)
+                      << " bytes) differs" << std::endl;
+            return 1;
+        }
+        printHashRate("Verified", size, start);
+        std::cout << partName << ": OK" << std::endl;
+        return 0;
+    }
+
+    android::base::unique_fd imageFd(open(referencePath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (imageFd < 0) {
+        std::cerr << "Unable to open " << referencePath << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    uint32_t magic = 0;
+    if (pread(imageFd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == SPARSE_HEADER_MAGIC) {
+        std::cerr << "Sparse images cannot be verified directly; compare against the raw image or a hash file"
+                  << std::endl;
+        return 1;
+    }
+    struct stat st;
+    if (fstat(imageFd, &st) != 0) {
+        std::cerr << "Unable to stat " << referencePath << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    uint64_t imageSize = st.st_size;
+    if (imageSize > size) {
+        std::cerr << "Mismatch: " << referencePath << " is " << imageSize << " bytes, larger than " << partName
+                  << " (" << size << " bytes)" << std::endl;
+        return 1;
+    }
+    uint64_t mismatch;
+    if (!compareWithImage(reader, imageFd, imageSize, &mismatch)) {
+        std::cerr << "Failed to read " << partName << " or " << referencePath << std::endl;
+        return 1;
+    }
+    if (mismatch != UINT64_MAX) {
+        std::cerr << "Mismatch: " << partName << " differs from " << referencePath << " at offset " << mismatch
+                  << std::endl;
+        return 1;
+    }
+    printHashRate("Verified", imageSize, start);
+    std::cout << partName << ": OK" << std::endl;
+    return 0;
+}
+
+// A --make-super manifest. Sizes are in bytes; see readSuperManifest for the syntax.
+struct ManifestPartition {
+    string name;
+    string group;
+    uint32_t attributes;
+    // Zero means the size of |image|.
+    uint64_t size;
+    string image;
+};
+
+struct SuperManifest {
+    uint64_t size = 0;
+    uint32_t metadataSize = 65536;
+    uint32_t metadataSlots = 2;
+    uint32_t alignment = kDefaultPartitionAlignment;
+    uint32_t blockSize = kDefaultBlockSize;
+    std::vector<std::pair<string, uint64_t>> groups;
+    std::vector<ManifestPartition> partitions;
+};
+
+//   size <bytes>
+//   metadata-size <bytes>      (default 65536)
+//   metadata-slots <count>     (default 2)
+//   alignment <bytes>          (default 1 MiB)
+//   block-size <bytes>         (default 4096)
+//   group <name> <max size, 0 for unlimited>
+//   partition <name> <group> <none|readonly> <size|auto> [image]
+bool readSuperManifest(const string& path, SuperManifest* manifest) {
+    std::ifstream file(path);
+    if (!file.good()) {
+        std::cerr << "Error: Unable to open manifest: " << path << std::endl;
+        return false;
+    }
+    string line;
+    for (size_t lineNumber = 1; std::getline(file, line); lineNumber++) {
+        auto args = splitLine(line);
+        if (args.empty()) {
+            continue;
+        }
+        auto fail = [&](const string& message) {
+            std::cerr << "Error: " << path << ":" << lineNumber << ": " << message << std::endl;
+            return false;
+        };
+        uint64_t value = 0;
+        if (args[0] == "size" || args[0] == "metadata-size" || args[0] == "metadata-slots" ||
+            args[0] == "alignment" || args[0] == "block-size") {
+            if (args.size() != 2 || !parseSize(args[1], &value) || value == 0 ||
+                (args[0] != "size" && value > UINT32_MAX)) {
+                return fail("'" + args[0] + "' expects one positive number");
+            }
+            if (args[0] == "size") {
+                manifest->size = value;
+            } else if (args[0] == "metadata-size") {
+                manifest->metadataSize = value;
+            } else if (args[0] == "metadata-slots") {
+                manifest->metadataSlots = value;
+            } else if (args[0] == "alignment") {
+                manifest->alignment = value;
+            } else {
+                manifest->blockSize = value;
+            }
+        } else if (args[0] == "group") {
+            if (args.size() != 3 || !parseSize(args[2], &value)) {
+                return fail("expected 'group <name> <max size>'");
+            }
+            manifest->groups.emplace_back(args[1], value);
+        } else if (args[0] == "partition") {
+            if (args.size() != 5 && args.size() != 6) {
+                return fail("expected 'partition <name> <group> <none|readonly> <size|auto> [image]'");
+            }
+            ManifestPartition partition = {args[1], args[2], LP_PARTITION_ATTR_NONE, 0,
+                                           args.size() == 6 ? args[5] : ""};
+            if (args[3] == "readonly") {
+                partition.attributes = LP_PARTITION_ATTR_READONLY;
+            } else if (args[3] != "none") {
+                return fail("unknown attribute '" + args[3] + "'");
+            }
+            if (args[4] == "auto") {
+                if (partition.image.empty()) {
+                    return fail("'auto' size needs an image");
+                }
+            } else if (!parseSize(args[4], &partition.size)) {
+                return fail("invalid size '" + args[4] + "'");
+            }
+            manifest->partitions.push_back(std::move(partition));
+        } else {
+            return fail("unknown keyword '" + args[0] + "'");
+        }
+    }
+    if (manifest->size == 0) {
+        std::cerr << "Error: " << path << " does not set the super size" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// A run of a partition image: |length| bytes at |fileOffset| of the image file, or
+// |fill| repeated. DONT_CARE chunks of sparse images have no span at all.
+struct ImageSpan {
+    uint64_t logical;
+    uint64_t length;
+    bool isFill;
+    uint32_t fill;
+    uint64_t fileOffset;
+};
+
+struct PartitionImage {
+    android::base::unique_fd fd;
+    uint64_t size = 0;
+    std::vector<ImageSpan> spans;
+};
+
+// The on-disk sparse format. libsparse only exports the parser that expands images,
+// and --make-super needs the file offsets of RAW chunks to reference them instead.
+struct SparseImageHeader {
+    uint32_t magic;
+    uint16_t majorVersion;
+    uint16_t minorVersion;
+    uint16_t fileHeaderSize;
+    uint16_t chunkHeaderSize;
+    uint32_t blockSize;
+    uint32_t totalBlocks;
+    uint32_t totalChunks;
+    uint32_t checksum;
+};
+
+struct SparseChunkHeader {
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t blocks;
+    uint32_t totalSize;
+};
+
+static constexpr uint16_t kSparseChunkRaw = 0xCAC1;
+static constexpr uint16_t kSparseChunkFill = 0xCAC2;
+static constexpr uint16_t kSparseChunkDontCare = 0xCAC3;
+static constexpr uint16_t kSparseChunkCrc32 = 0xCAC4;
+
+// One chunk of a sparse image: |blocks| blocks from |block| on, with its header at
+// |offset| of the file and |size| bytes including the header.
+struct SparseChunk {
+    uint16_t type;
+    uint64_t block;
+    uint32_t blocks;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t fill;
+};
+
+// Walks the chunk headers of a sparse image without reading any chunk data.
+static bool readSparseChunks(int fd, const string& path, SparseImageHeader* header, std::vector<SparseChunk>* chunks) {
+    if (!android::base::ReadFullyAtOffset(fd, header, sizeof(*header), 0) ||
+        header->fileHeaderSize < sizeof(*header) || header->chunkHeaderSize < sizeof(SparseChunkHeader) ||
+        header->blockSize == 0 || header->blockSize % 4 != 0) {
+        std::cerr << "Unable to parse sparse image " << path << std::endl;
+        return false;
+    }
+    uint64_t offset = header->fileHeaderSize;
+    uint64_t block = 0;
+    for (uint32_t i = 0; i < header->totalChunks; i++) {
+        SparseChunkHeader chunk;
+        if (!android::base::ReadFullyAtOffset(fd, &chunk, sizeof(chunk), offset)) {
+            std::cerr << "Unable to read chunk " << i << " of " << path << std::endl;
+            return false;
+        }
+        uint64_t length = uint64_t(chunk.blocks) * header->blockSize;
+        uint64_t dataSize = chunk.totalSize - header->chunkHeaderSize;
+        uint32_t fill = 0;
+        bool valid = chunk.totalSize >= header->chunkHeaderSize;
+        if (chunk.type == kSparseChunkRaw) {
+            valid &= dataSize == length;
+        } else if (chunk.type == kSparseChunkFill) {
+            valid &= dataSize == sizeof(fill) &&
+                     android::base::ReadFullyAtOffset(fd, &fill, sizeof(fill), offset + header->chunkHeaderSize);
+        } else if (chunk.type == kSparseChunkCrc32) {
+            chunk.blocks = 0;
+        } else {
+            valid &= chunk.type == kSparseChunkDontCare;
+        }
+        // Chunks past the size in the header would be written beyond the partition.
+        valid &= block + chunk.blocks <= header->totalBlocks;
+        if (!valid) {
+            std::cerr << "Corrupt chunk " << i << " in " << path << std::endl;
+            return false;
+        }
+        chunks->push_back({chunk.type, block, chunk.blocks, offset, chunk.totalSize, fill});
+        block += chunk.blocks;
+        offset += chunk.totalSize;
+    }
+    if (block != header->totalBlocks) {
+        std::cerr << "Chunks of " << path << " cover " << block << " blocks, the header says " << header->totalBlocks
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Indexes the chunks of a sparse image by reading only the headers.
+bool readSparseSpans(const string& path, PartitionImage* image) {
+    SparseImageHeader header;
+    std::vector<SparseChunk> chunks;
+    if (!readSparseChunks(image->fd, path, &header, &chunks)) {
+        return false;
+    }
+    uint64_t logical = 0;
+    for (const auto& chunk : chunks) {
+        uint64_t length = uint64_t(chunk.blocks) * header.blockSize;
+        if (chunk.type == kSparseChunkRaw) {
+            image->spans.push_back({logical, length, false, 0, chunk.offset + header.chunkHeaderSize});
+        } else if (chunk.type == kSparseChunkFill) {
+            image->spans.push_back({logical, length, true, chunk.fill, 0});
+        }
+        logical += length;
+    }
+    image->size = logical;
+    return true;
+}
+
+bool openPartitionImage(const string& path, PartitionImage* image) {
+    image->fd.reset(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (image->fd < 0) {
+        std::cerr << "Unable to open " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    uint32_t magic = 0;
+    if (pread(image->fd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == SPARSE_HEADER_MAGIC) {
+        return readSparseSpans(path, image);
+    }
+    struct stat st;
+    if (fstat(image->fd, &st) != 0) {
+        std::cerr << "Unable to stat " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    image->size = st.st_size;
+    image->spans.push_back({0, image->size, false, 0, 0});
+    posix_fadvise(image->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return true;
+}
+
+// Calls fn(span, offset into the span, physical offset on super, length) for every
+// piece of |image| that lands in one extent of the partition.
+template <typename Fn>
+bool forEachImagePiece(const PartitionImage& image, const std::vector<PartitionRange>& ranges, Fn fn) {
+    for (const auto& span : image.spans) {
+        for (const auto& range : ranges) {
+            uint64_t start = std::max(span.logical, range.logical);
+            uint64_t end = std::min(span.logical + span.length, range.logical + range.length);
+            if (start >= end) {
+                continue;
+            }
+            if (range.zero) {
+                std::cerr << "Unable to write to a zero extent at offset " << start << std::endl;
+                return false;
+            }
+            if (!fn(span, start - span.logical, range.physical + (start - range.logical), end - start)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Copies one image into its extents of a raw super image. Zero fills are left as the
+// holes the freshly truncated output already has.
+bool writeRawImage(const PartitionImage& image, const std::vector<PartitionRange>& ranges, int outFd,
+                   bool* zeroCopy) {
+    std::vector<uint8_t> pattern;
+    return forEachImagePiece(image, ranges, [&](const ImageSpan& span, uint64_t offset, uint64_t physical,
+                                                uint64_t length) {
+        if (!span.isFill) {
+            return copyRange(image.fd, span.fileOffset + offset, outFd, physical, length, zeroCopy);
+        }
+        if (span.fill == 0) {
+            return true;
+        }
+        pattern.resize(std::min<uint64_t>(length, kIoBufferSize) / sizeof(span.fill) * sizeof(span.fill));
+        for (size_t i = 0; i < pattern.size(); i += sizeof(span.fill)) {
+            memcpy(&pattern[i], &span.fill, sizeof(span.fill));
+        }
+        for (uint64_t done = 0; done < length;) {
+            size_t n = std::min<uint64_t>(length - done, pattern.size());
+            if (!throttledWriteAt(outFd, pattern.data(), n, physical + done)) {
+                std::cerr << "Write failed at " << physical + done << ": " << strerror(errno) << std::endl;
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    });
+}
+
+// Adds one image to a sparse super image as references into the image file, so the
+// data is read exactly once, while libsparse writes the output.
+bool addSparseImage(sparse_file* out, uint32_t blockSize, const PartitionImage& image,
+                    const std::vector<PartitionRange>& ranges) {
+    return forEachImagePiece(image, ranges, [&](const ImageSpan& span, uint64_t offset, uint64_t physical,
+                                                uint64_t length) {
+        // Only the last piece of a raw image may end inside a block; libsparse pads it.
+        if (physical % blockSize != 0 || (length % blockSize != 0 && span.logical + offset + length != image.size)) {
+            std::cerr << "Image data at offset " << span.logical + offset << " is not aligned to " << blockSize
+                      << " bytes" << std::endl;
+            return false;
+        }
+        unsigned int block = physical / blockSize;
+        if (span.isFill) {
+            return sparse_file_add_fill(out, span.fill, length, block) == 0;
+        }
+        return sparse_file_add_fd(out, image.fd, span.fileOffset + offset, length, block) == 0;
+    });
+}
+
+std::unique_ptr<LpMetadata> buildSuperMetadata(const SuperManifest& manifest,
+                                               const std::vector<PartitionImage>& images,
+                                               std::unique_ptr<MetadataBuilder>* builder) {
+    BlockDeviceInfo device(LP_METADATA_DEFAULT_PARTITION_NAME, manifest.size, manifest.alignment, 0,
+                           manifest.blockSize);
+    *builder = MetadataBuilder::New(device, manifest.metadataSize, manifest.metadataSlots);
+    if (!*builder) {
+        std::cerr << "Unable to create metadata for a " << manifest.size << " byte super" << std::endl;
+        return nullptr;
+    }
+    for (const auto& [name, maxSize] : manifest.groups) {
+        if (!(*builder)->AddGroup(name, maxSize)) {
+            std::cerr << "Unable to add group " << name << std::endl;
+            return nullptr;
+        }
+    }
+    for (size_t i = 0; i < manifest.partitions.size(); i++) {
+        const auto& entry = manifest.partitions[i];
+        uint64_t size = entry.size == 0 ? images[i].size : entry.size;
+        if (images[i].size > size) {
+            std::cerr << entry.image << " (" << images[i].size << " bytes) does not fit " << entry.name << " ("
+                      << size << " bytes)" << std::endl;
+            return nullptr;
+        }
+        auto partition = (*builder)->AddPartition(entry.name, entry.group, entry.attributes);
+        if (partition == nullptr) {
+            std::cerr << "Unable to add partition " << entry.name << std::endl;
+            return nullptr;
+        }
+        if (!(*builder)->ResizePartition(partition, size)) {
+            std::cerr << "Not enough space for " << entry.name << " (" << size << " bytes)" << std::endl;
+            return nullptr;
+        }
+    }
+    return (*builder)->Export();
+}
+
+// Writes the geometry and every metadata slot. liblp only writes through a partition
+// opener, so the tables always go to a file of the full super size.
+bool flashSuperTables(const string& path, uint64_t size, const LpMetadata& metadata) {
+    android::base::unique_fd fd(open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        std::cerr << "Unable to create " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    SuperPartitionOpener opener(path);
+    opener.set_defer_sync(true);
+    TraceScope trace("FlashPartitionTable");
+    if (!FlashPartitionTable(opener, path, metadata)) {
+        std::cerr << "Unable to write the partition tables to " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Builds a super image from |manifestPath| in one pass. Images are referenced where they
+// are, so a raw output is only written where partitions have data, and a sparse output
+// never exists as a raw image anywhere.
+int makeSuper(const string& manifestPath, const string& outPath, bool sparseOutput) {
+    SuperManifest manifest;
+    if (!readSuperManifest(manifestPath, &manifest)) {
+        return 1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<PartitionImage> images(manifest.partitions.size());
+    std::atomic<bool> ok{true};
+    {
+        TraceScope trace("OpenImages");
+        parallelFor(images.size(), hardwareWorkers(), [&](size_t i) {
+            const auto& image = manifest.partitions[i].image;
+            if (!image.empty() && !openPartitionImage(image, &images[i])) {
+                ok = false;
+            }
+        });
+    }
+    if (!ok) {
+        return 1;
+    }
+    std::unique_ptr<MetadataBuilder> builder;
+    auto metadata = buildSuperMetadata(manifest, images, &builder);
+    if (!metadata) {
+        return 1;
+    }
+    std::vector<std::vector<PartitionRange>> ranges(images.size());
+    uint64_t imageBytes = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+        if (!getPartitionRanges(builder->FindPartition(manifest.partitions[i].name), &ranges[i])) {
+            return 1;
+        }
+        imageBytes += images[i].size;
+    }
+
+    bool zeroCopy = true;
+    if (!sparseOutput) {
+        if (!flashSuperTables(outPath, manifest.size, *metadata.get())) {
+            return 1;
+        }
+        android::base::unique_fd outFd(open(outPath.c_str(), O_WRONLY | O_CLOEXEC));
+        if (outFd < 0) {
+            std::cerr << "Unable to open " << outPath << ": " << strerror(errno) << std::endl;
+            return 1;
+        }
+        std::atomic<bool> allZeroCopy{true};
+        {
+            TraceScope trace("WriteImages");
+            parallelFor(images.size(), hardwareWorkers(), [&](size_t i) {
+                bool imageZeroCopy = true;
+                if (!writeRawImage(images[i], ranges[i], outFd, &imageZeroCopy)) {
+                    std::cerr << "Failed to write " << manifest.partitions[i].name << std::endl;
+                    ok = false;
+                }
+                if (!imageZeroCopy) {
+                    allZeroCopy = false;
+                }
+            });
+        }
+        zeroCopy = allZeroCopy;
+        if (!ok || fsync(outFd) != 0) {
+            std::cerr << "Failed to write " << outPath << std::endl;
+            return 1;
+        }
+    } else {
+        // The tables are the only data that has to be generated; the file holding them
+        // is unlinked right away and stays a hole everywhere else.
+        string tablesPath = outPath + ".tables";
+        bool flashed = flashSuperTables(tablesPath, manifest.size, *metadata.get());
+        android::base::unique_fd tablesFd(open(tablesPath.c_str(), O_RDONLY | O_CLOEXEC));
+        unlink(tablesPath.c_str());
+        if (!flashed || tablesFd < 0) {
+            return 1;
+        }
+        std::unique_ptr<sparse_file, decltype(&sparse_file_destroy)> sparse(
+                sparse_file_new(manifest.blockSize, manifest.size), sparse_file_destroy);
+        if (!sparse) {
+            std::cerr << "Unable to allocate sparse image" << std::endl;
+            return 1;
+        }
+        uint64_t tablesSize = metadata->block_devices[0].first_logical_sector * LP_SECTOR_SIZE;
+        if (sparse_file_add_fd(sparse.get(), tablesFd, 0, tablesSize, 0) != 0) {
+            return 1;
+        }
+        for (size_t i = 0; i < images.size(); i++) {
+            if (!addSparseImage(sparse.get(), manifest.blockSize, images[i], ranges[i])) {
+                std::cerr << "Failed to add " << manifest.partitions[i].name << std::endl;
+                return 1;
+            }
+        }
+        android::base::unique_fd outFd(open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        if (outFd < 0) {
+            std::cerr << "Unable to open " << outPath << ": " << strerror(errno) << std::endl;
+            return 1;
+        }
+        TraceScope trace("WriteSparseImage");
+        if (sparse_file_write(sparse.get(), outFd, false, true, false) != 0 || fsync(outFd) != 0) {
+            std::cerr << "Unable to write sparse image " << outPath << std::endl;
+            return 1;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Built %s: %zu partitions, %" PRIu64 " bytes of images, %s, %.2f s, %.2f MB/s\n", outPath.c_str(),
+           images.size(), imageBytes, sparseOutput ? "sparse" : (zeroCopy ? "zero-copy" : "buffered copy"),
+           seconds, seconds > 0 ? imageBytes / 1024.0 / 1024.0 / seconds : 0.0);
+    return 0;
+}
+
+// Everything below works in 512-byte sectors on the first block device (super).
+struct DefragExtent {
+    uint64_t physical;
+    uint64_t sectors;
+    bool zero;
+};
+
+struct DefragPartition {
+    string name;
+    bool inScope;
+    bool movable;
+    std::vector<DefragExtent> extents;
+};
+
+struct DefragLayout {
+    uint64_t firstSector;
+    uint64_t lastSector;
+    uint64_t alignment;
+    // Set when adjacent extents were merged while loading, which needs a commit even
+    // if no data moves.
+    bool merged;
+    std::vector<DefragPartition> partitions;
+};
+
+// A relocation copies a whole partition into one free region; a slide moves a single
+// extent down into the gap right below it to push free space towards the end.
+struct DefragStep {
+    enum Kind { kRelocate, kSlide } kind;
+    size_t partition;
+    size_t extent;
+    uint64_t source;
+    uint64_t destination;
+    uint64_t sectors;
+};
+
+static constexpr uint64_t kDefragSyncInterval = 256 * 1024 * 1024;
+// Slides shorter than this are not worth it: a slide is checkpointed once per shift
+// distance, so short ones spend their time syncing the journal.
+static constexpr uint64_t kDefragMinSlide = 1024 * 1024;
+
+void mergeDefragExtents(DefragPartition* partition) {
+    std::vector<DefragExtent> merged;
+    for (const auto& extent : partition->extents) {
+        if (!merged.empty() && !extent.zero && !merged.back().zero &&
+            merged.back().physical + merged.back().sectors == extent.physical) {
+            merged.back().sectors += extent.sectors;
+        } else {
+            merged.push_back(extent);
+        }
+    }
+    partition->extents = std::move(merged);
+}
+
+bool isFragmented(const DefragPartition& partition) {
+    if (partition.extents.size() < 2) {
+        return false;
+    }
+    for (const auto& extent : partition.extents) {
+        if (extent.zero) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t partitionSectors(const DefragPartition& partition) {
+    uint64_t sectors = 0;
+    for (const auto& extent : partition.extents) {
+        sectors += extent.sectors;
+    }
+    return sectors;
+}
+
+bool loadDefragLayout(PartitionBuilder& builder, const string& superPath, const string& scopeGroup,
+                      DefragLayout* layout) {
+    bool useDm = isBlockDevice(superPath);
+    auto metadata = exportMetadata(builder);
+    if (!metadata || metadata->block_devices.empty()) {
+        std::cerr << "Failed to export metadata" << std::endl;
+        return false;
+    }
+    const auto& super = metadata->block_devices[0];
+    layout->firstSector = super.first_logical_sector;
+    layout->lastSector = super.size / LP_SECTOR_SIZE;
+    layout->alignment = std::max<uint64_t>(1, super.alignment / LP_SECTOR_SIZE);
+    layout->merged = false;
+    for (const auto& groupName : builder->ListGroups()) {
+        for (const auto& partition : builder->ListPartitionsInGroup(groupName)) {
+            DefragPartition entry = {partition->name(), scopeGroup.empty() || groupName == scopeGroup,
+                                     !useDm || !isMapped(partition->name()), {}};
+            for (const auto& extent : partition->extents()) {
+                auto linear = extent->AsLinearExtent();
+                if (linear != nullptr && linear->device_index() != 0) {
+                    std::cerr << "Partition " << partition->name() << " has extents outside of super, which is not supported" << std::endl;
+                    return false;
+                }
+                entry.extents.push_back({linear ? linear->physical_sector() : 0, extent->num_sectors(), linear == nullptr});
+            }
+            size_t count = entry.extents.size();
+            mergeDefragExtents(&entry);
+            layout->merged |= entry.extents.size() != count;
+            layout->partitions.push_back(std::move(entry));
+        }
+    }
+    return true;
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> defragFreeRegions(const DefragLayout& layout) {
+    std::vector<std::pair<uint64_t, uint64_t>> used;
+    for (const auto& partition : layout.partitions) {
+        for (const auto& extent : partition.extents) {
+            if (!extent.zero) {
+                used.emplace_back(extent.physical, extent.physical + extent.sectors);
+            }
+        }
+    }
+    std::sort(used.begin(), used.end());
+    std::vector<std::pair<uint64_t, uint64_t>> free;
+    uint64_t cursor = layout.firstSector;
+    for (const auto& [start, end] : used) {
+        if (start > cursor) {
+            free.emplace_back(cursor, start);
+        }
+        cursor = std::max(cursor, end);
+    }
+    if (cursor < layout.lastSector) {
+        free.emplace_back(cursor, layout.lastSector);
+    }
+    return free;
+}
+
+// Picks the next move, or nothing once every fragmented partition in scope is either
+// contiguous or cannot be helped. Deterministic, so --dry-run plans the same moves.
+std::optional<DefragStep> planDefragStep(const DefragLayout& layout) {
+    // Data only ever moves to aligned sectors, so the part of a gap below its first
+    // aligned sector is unusable.
+    auto free = defragFreeRegions(layout);
+    for (auto& [start, end] : free) {
+        start = std::min(end, (start + layout.alignment - 1) / layout.alignment * layout.alignment);
+    }
+    uint64_t totalFree = 0;
+    for (const auto& [start, end] : free) {
+        totalFree += end - start;
+    }
+    bool canSlide = false;
+    for (size_t i = 0; i < layout.partitions.size(); i++) {
+        const auto& partition = layout.partitions[i];
+        if (!partition.inScope || !partition.movable || !isFragmented(partition)) {
+            continue;
+        }
+        uint64_t sectors = partitionSectors(partition);
+        // Best fit: the smallest free region that holds the whole partition.
+        std::optional<DefragStep> best;
+        uint64_t bestSize = 0;
+        for (const auto& [start, end] : free) {
+            if (start + sectors > end || (best && end - start >= bestSize)) {
+                continue;
+            }
+            best = DefragStep{DefragStep::kRelocate, i, 0, partition.extents[0].physical, start, sectors};
+            bestSize = end - start;
+        }
+        if (best) {
+            return best;
+        }
+        canSlide |= sectors <= totalFree;
+    }
+    if (!canSlide) {
+        return std::nullopt;
+    }
+    // Nothing fits anywhere, so consolidate free space: move the lowest movable extent
+    // in scope that sits directly above a gap down into it. Partitions of other groups
+    // stay where they are, even if that leaves the group fragmented.
+    std::optional<DefragStep> slide;
+    for (size_t i = 0; i < layout.partitions.size(); i++) {
+        const auto& partition = layout.partitions[i];
+        if (!partition.inScope || !partition.movable) {
+            continue;
+        }
+        for (size_t e = 0; e < partition.extents.size(); e++) {
+            const auto& extent = partition.extents[e];
+            if (extent.zero || (slide && extent.physical >= slide->source)) {
+                continue;
+            }
+            for (const auto& [start, end] : free) {
+                if (end == extent.physical && end - start >= kDefragMinSlide / LP_SECTOR_SIZE) {
+                    slide = DefragStep{DefragStep::kSlide, i, e, extent.physical, start, extent.sectors};
+                    break;
+                }
+            }
+        }
+    }
+    return slide;
+}
+
+void applyDefragStep(DefragLayout* layout, const DefragStep& step) {
+    auto& partition = layout->partitions[step.partition];
+    if (step.kind == DefragStep::kRelocate) {
+        partition.extents = {{step.destination, step.sectors, false}};
+    } else {
+        partition.extents[step.extent].physical = step.destination;
+        mergeDefragExtents(&partition);
+    }
+}
+
+void printDefragStep(const DefragLayout& layout, const DefragStep& step) {
+    const auto& partition = layout.partitions[step.partition];
+    if (step.kind == DefragStep::kRelocate) {
+        printf("relocate %s: %zu extents -> sector %" PRIu64 ", %" PRIu64 " bytes\n", partition.name.c_str(),
+               partition.extents.size(), step.destination, step.sectors * LP_SECTOR_SIZE);
+    } else {
+        printf("slide %s extent %zu: sector %" PRIu64 " -> %" PRIu64 ", %" PRIu64 " bytes\n", partition.name.c_str(),
+               step.extent, step.source, step.destination, step.sectors * LP_SECTOR_SIZE);
+    }
+}
+
+// The journal describes the move in progress and how many bytes of it are durable
+// on disk. It is written before the copy starts and removed after the metadata
+// commit, so an interrupted --defrag can pick up where it stopped.
+struct DefragJournal {
+    string kind;
+    string partition;
+    uint64_t extent = 0;
+    uint64_t source = 0;
+    uint64_t destination = 0;
+    uint64_t sectors = 0;
+    uint64_t done = 0;
+};
+
+bool writeDefragJournal(const string& path, const DefragJournal& journal) {
+    string content = android::base::StringPrintf(
+            "kind=%s\npartition=%s\nextent=%" PRIu64 "\nsource=%" PRIu64 "\ndestination=%" PRIu64
+            "\nsectors=%" PRIu64 "\ndone=%" PRIu64 "\n",
+            journal.kind.c_str(), journal.partition.c_str(), journal.extent, journal.source,
+            journal.destination, journal.sectors, journal.done);
+    string tmpPath = path + ".tmp";
+    android::base::unique_fd fd(open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (fd < 0 || !android::base::WriteStringToFd(content, fd) || fsync(fd) != 0 ||
+        rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "Unable to write defrag journal " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool readDefragJournal(const string& path, DefragJournal* journal) {
+    string content;
+    if (!android::base::ReadFileToString(path, &content)) {
+        return false;
+    }
+    for (const auto& line : android::base::Split(content, "\n")) {
+        auto eq = line.find('=');
+        if (eq == string::npos) {
+            continue;
+        }
+        auto key = line.substr(0, eq);
+        auto value = line.substr(eq + 1);
+        if (key == "kind") {
+            journal->kind = value;
+        } else if (key == "partition") {
+            journal->partition = value;
+        } else if (key == "extent") {
+            android::base::ParseUint(value, &journal->extent);
+        } else if (key == "source") {
+            android::base::ParseUint(value, &journal->source);
+        } else if (key == "destination") {
+            android::base::ParseUint(value, &journal->destination);
+        } else if (key == "sectors") {
+            android::base::ParseUint(value, &journal->sectors);
+        } else if (key == "done") {
+            android::base::ParseUint(value, &journal->done);
+        }
+    }
+    return true;
+}
+
+// Copies the data of |step| starting at |journal->done|, checkpointing the journal
+// after every durable window. A slide may overlap its own source; it always moves
+// data down, and the window is capped at the shift distance (at least kDefragMinSlide)
+// so that nothing written since the last checkpoint can overlap source data that a
+// resumed run reads again.
+bool copyDefragStep(const string& superPath, const DefragPartition& partition, const DefragStep& step,
+                    const string& journalPath, DefragJournal* journal) {
+    std::vector<PartitionRange> sources;
+    uint64_t window = kDefragSyncInterval;
+    if (step.kind == DefragStep::kSlide) {
+        sources.push_back({0, step.source * LP_SECTOR_SIZE, step.sectors * LP_SECTOR_SIZE, false});
+        window = std::min(window, (step.source - step.destination) * LP_SECTOR_SIZE);
+    } else {
+        uint64_t logical = 0;
+        for (const auto& extent : partition.extents) {
+            sources.push_back({logical, extent.physical * LP_SECTOR_SIZE, extent.sectors * LP_SECTOR_SIZE, false});
+            logical += extent.sectors * LP_SECTOR_SIZE;
+        }
+    }
+    uint64_t length = step.sectors * LP_SECTOR_SIZE;
+    ExtentReader reader;
+    ExtentWriter extentWriter;
+    if (!reader.Open(superPath, std::move(sources)) ||
+        !extentWriter.Open(superPath, {{0, step.destination * LP_SECTOR_SIZE, length, false}})) {
+        return false;
+    }
+    auto buffer = allocateAligned(kIoBufferSize);
+    if (!buffer) {
+        return false;
+    }
+    PipelinedWriter writer(&extentWriter);
+    for (uint64_t offset = journal->done; offset < length;) {
+        uint64_t checkpoint = std::min(length, offset + window);
+        while (offset < checkpoint) {
+            size_t n = std::min<uint64_t>(kIoBufferSize, checkpoint - offset);
+            if (!reader.Read(offset, buffer.get(), n) || !writer.Append(offset, buffer.get(), n)) {
+                return false;
+            }
+            offset += n;
+        }
+        if (!writer.Sync()) {
+            return false;
+        }
+        journal->done = offset;
+        if (!writeDefragJournal(journalPath, *journal)) {
+            return false;
+        }
+    }
+    return writer.Finish();
+}
+
+bool commitDefragLayout(PartitionBuilder& builder, const DefragLayout& layout, const string& superPath,
+                        int slotValue) {
+    for (const auto& entry : layout.partitions) {
+        auto partition = builder->FindPartition(entry.name);
+        if (partition == nullptr) {
+            return false;
+        }
+        partition->RemoveExtents();
+        for (const auto& extent : entry.extents) {
+            if (extent.zero) {
+                partition->AddExtent(std::make_unique<ZeroExtent>(extent.sectors));
+            } else {
+                partition->AddExtent(std::make_unique<LinearExtent>(extent.sectors, 0, extent.physical));
+            }
+        }
+    }
+    auto metadata = exportMetadata(builder);
+    if (!metadata || !UpdateAllPartitionMetadata(superPath, *metadata.get(), slotValue)) {
+        std::cerr << "Failed to write partition table" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Copies the data of one step, commits the resulting layout and drops the journal.
+bool executeDefragStep(PartitionBuilder& builder, DefragLayout* layout, const DefragStep& step,
+                       const string& superPath, int slotValue, const string& journalPath,
+                       DefragJournal* journal) {
+    if (!copyDefragStep(superPath, layout->partitions[step.partition], step, journalPath, journal)) {
+        std::cerr << "Defrag interrupted, rerun --defrag to resume from " << journalPath << std::endl;
+        return false;
+    }
+    applyDefragStep(layout, step);
+    if (!commitDefragLayout(builder, *layout, superPath, slotValue)) {
+        return false;
+    }
+    unlink(journalPath.c_str());
+    return true;
+}
+
+// Finishes a move that an earlier run left in the journal.
+bool resumeDefrag(PartitionBuilder& builder, DefragLayout* layout, const string& superPath, int slotValue,
+                  const string& journalPath) {
+    DefragJournal journal;
+    if (!readDefragJournal(journalPath, &journal)) {
+        return true;
+    }
+    auto it = std::find_if(layout->partitions.begin(), layout->partitions.end(),
+                           [&](const DefragPartition& p) { return p.name == journal.partition; });
+    if (it == layout->partitions.end()) {
+        std::cerr << "Defrag journal refers to missing partition " << journal.partition << std::endl;
+        return false;
+    }
+    DefragStep step = {journal.kind == "slide" ? DefragStep::kSlide : DefragStep::kRelocate,
+                       size_t(it - layout->partitions.begin()), journal.extent, journal.source,
+                       journal.destination, journal.sectors};
+    bool committed, pending;
+    if (step.kind == DefragStep::kSlide) {
+        // Merging after the commit may have folded the moved extent into its neighbour.
+        committed = std::any_of(it->extents.begin(), it->extents.end(), [&](const DefragExtent& e) {
+            return !e.zero && e.physical <= step.destination && step.destination + step.sectors <= e.physical + e.sectors;
+        });
+        pending = step.extent < it->extents.size() && it->extents[step.extent].physical == step.source &&
+                  it->extents[step.extent].sectors == step.sectors;
+    } else {
+        committed = it->extents.size() == 1 && it->extents[0].physical == step.destination;
+        pending = partitionSectors(*it) == step.sectors;
+    }
+    if (committed) {
+        unlink(journalPath.c_str());
+        return true;
+    }
+    if (!pending || !it->movable) {
+        std::cerr << "Defrag journal " << journalPath << " does not match the current layout" << std::endl;
+        return false;
+    }
+    std::cout << "Resuming after " << journal.done << " bytes: ";
+    printDefragStep(*layout, step);
+    return executeDefragStep(builder, layout, step, superPath, slotValue, journalPath, &journal);
+}
+
+// Moves partition data until every partition of |scopeGroup| (or of all groups when
+// empty) is a single contiguous extent. Mapped partitions are never moved.
+int defragSuper(PartitionBuilder& builder, const string& superPath, int slotValue, const string& scopeGroup,
+                bool dryRun, const string& journalPath) {
+    DefragLayout layout;
+    if (!loadDefragLayout(builder, superPath, scopeGroup, &layout)) {
+        return 1;
+    }
+    if (!dryRun && !resumeDefrag(builder, &layout, superPath, slotValue, journalPath)) {
+        return 1;
+    }
+    uint64_t totalBytes = 0;
+    size_t moves = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (auto step = planDefragStep(layout)) {
+        printDefragStep(layout, *step);
+        totalBytes += step->sectors * LP_SECTOR_SIZE;
+        moves++;
+        if (dryRun) {
+            applyDefragStep(&layout, *step);
+            continue;
+        }
+        DefragJournal journal = {step->kind == DefragStep::kSlide ? "slide" : "relocate",
+                                 layout.partitions[step->partition].name, step->extent, step->source,
+                                 step->destination, step->sectors, 0};
+        if (!writeDefragJournal(journalPath, journal) ||
+            !executeDefragStep(builder, &layout, *step, superPath, slotValue, journalPath, &journal)) {
+            return 1;
+        }
+    }
+    // Extents that only needed merging are written out even if no data moved.
+    if (!dryRun && moves == 0 && layout.merged && !commitDefragLayout(builder, layout, superPath, slotValue)) {
+        return 1;
+    }
+    for (const auto& partition : layout.partitions) {
+        if (!partition.inScope || !isFragmented(partition)) {
+            continue;
+        }
+        std::cout << partition.name << " remains fragmented ("
+                  << (partition.movable ? "not enough free space" : "partition is mapped") << ")" << std::endl;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%s %zu moves, %" PRIu64 " bytes to copy", dryRun ? "Planned" : "Completed", moves, totalBytes);
+    if (!dryRun) {
+        printf(", %.2f s", seconds);
+    }
+    printf("\n");
+    return 0;
+}
+
+std::vector<std::unique_ptr<Extent>> cloneExtents(const Partition* partition) {
+    std::vector<std::unique_ptr<Extent>> extents;
+    for (const auto& extent : partition->extents()) {
+        auto linear = extent->AsLinearExtent();
+        if (linear != nullptr) {
+            extents.push_back(std::make_unique<LinearExtent>(linear->num_sectors(), linear->device_index(), linear->physical_sector()));
+        } else {
+            extents.push_back(std::make_unique<ZeroExtent>(extent->num_sectors()));
+        }
+    }
+    return extents;
+}
+
+void setExtents(Partition* partition, std::vector<std::unique_ptr<Extent>> extents) {
+    partition->RemoveExtents();
+    for (auto&& extent : extents) {
+        partition->AddExtent(std::move(extent));
+    }
+}
+
+// Moving extents between partitions bypasses ResizePartition, so the group limits it
+// normally enforces are checked here before anything is written.
+bool checkGroupLimits(PartitionBuilder& builder) {
+    for (const auto& groupName : builder->ListGroups()) {
+        uint64_t maxSize = builder->FindGroup(groupName)->maximum_size();
+        uint64_t used = 0;
+        for (const auto& partition : builder->ListPartitionsInGroup(groupName)) {
+            used += partition->BytesOnDisk();
+        }
+        if (maxSize != 0 && used > maxSize) {
+            std::cerr << "Group " << groupName << " would use " << used << " of " << maxSize << " bytes" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool parseAllocPolicy(const string& value, AllocPolicy* policy) {
+    if (value == "best-fit") {
+        *policy = AllocPolicy::kBestFit;
+    } else if (value == "contiguous") {
+        *policy = AllocPolicy::kContiguous;
+    } else if (value == "end") {
+        *policy = AllocPolicy::kEnd;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Picks where |sectors| more sectors of |partition| go. Growing the last extent in
+// place is preferred by every policy since it adds no extent. Contiguous stops there
+// for a partition that already has extents, since anything else would split it.
+// Otherwise best-fit and contiguous take the smallest free region that holds all of
+// it, and end the highest one, placed at its top. Returns false if nothing fits.
+bool placeGrowth(const Partition* partition, const std::vector<std::pair<uint64_t, uint64_t>>& free,
+                 uint64_t sectors, uint64_t alignment, AllocPolicy policy, uint64_t* start) {
+    if (!partition->extents().empty()) {
+        auto last = partition->extents().back()->AsLinearExtent();
+        if (last != nullptr && last->device_index() == 0) {
+            for (const auto& [regionStart, regionEnd] : free) {
+                if (regionStart == last->end_sector() && regionEnd - regionStart >= sectors) {
+                    *start = regionStart;
+                    return true;
+                }
+            }
+        }
+        if (policy == AllocPolicy::kContiguous) {
+            return false;
+        }
+    }
+    std::optional<std::pair<uint64_t, uint64_t>> best;
+    for (const auto& [regionStart, regionEnd] : free) {
+        if (policy == AllocPolicy::kEnd) {
+            if (regionEnd < sectors) {
+                continue;
+            }
+            uint64_t top = (regionEnd - sectors) / alignment * alignment;
+            if (top >= regionStart && (!best || top > best->first)) {
+                best = {top, 0};
+            }
+        } else {
+            uint64_t aligned = (regionStart + alignment - 1) / alignment * alignment;
+            if (aligned + sectors <= regionEnd && (!best || regionEnd - regionStart < best->second)) {
+                best = {aligned, regionEnd - regionStart};
+            }
+        }
+    }
+    if (!best) {
+        return false;
+    }
+    *start = best->first;
+    return true;
+}
+
+// Resizes |partition| to |size| bytes following |policy|. Shrinking, and growing
+// with the default policy, is left to MetadataBuilder, which takes the first free
+// space it finds and splits the growth over as many regions as it needs.
+bool resizeWithPolicy(PartitionBuilder& builder, Partition* partition, uint64_t size, AllocPolicy policy) {
+    TraceScope trace("ResizePartition", partition->name());
+    if (policy == AllocPolicy::kDefault || size <= partition->size()) {
+        return builder->ResizePartition(partition, size);
+    }
+    auto metadata = exportMetadata(builder);
+    if (!metadata || metadata->block_devices.empty()) {
+        std::cerr << "Failed to export metadata" << std::endl;
+        return false;
+    }
+    uint64_t blockSize = metadata->geometry.logical_block_size;
+    uint64_t alignment = std::max<uint64_t>(1, metadata->block_devices[0].alignment / LP_SECTOR_SIZE);
+    size = (size + blockSize - 1) / blockSize * blockSize;
+    uint64_t sectors = (size - partition->size()) / LP_SECTOR_SIZE;
+
+    uint64_t start;
+    if (!placeGrowth(partition, superFreeRegions(*metadata.get()), sectors, alignment, policy, &start)) {
+        if (policy == AllocPolicy::kContiguous) {
+            std::cerr << (partition->extents().empty() ? "No free region holds " : "No free space right after ")
+                      << partition->name() << " for " << sectors * LP_SECTOR_SIZE
+                      << " more bytes without splitting it" << std::endl;
+            return false;
+        }
+        return builder->ResizePartition(partition, size);
+    }
+    auto original = cloneExtents(partition);
+    auto extents = cloneExtents(partition);
+    auto last = extents.empty() ? nullptr : extents.back()->AsLinearExtent();
+    if (last != nullptr && last->device_index() == 0 && last->end_sector() == start) {
+        extents.back() = std::make_unique<LinearExtent>(last->num_sectors() + sectors, 0, last->physical_sector());
+    } else {
+        extents.push_back(std::make_unique<LinearExtent>(sectors, 0, start));
+    }
+    setExtents(partition, std::move(extents));
+    if (!checkGroupLimits(builder)) {
+        setExtents(partition, std::move(original));
+        return false;
+    }
+    return true;
+}
+
+// libdm has no rename call, so DM_DEV_RENAME is issued directly. The table is left
+// untouched, so open handles keep working.
+bool renameDmDevice(const string& oldName, const string& newName) {
+    android::base::unique_fd fd(open("/dev/device-mapper", O_RDWR | O_CLOEXEC));
+    if (fd < 0) {
+        std::cerr << "Unable to open /dev/device-mapper: " << strerror(errno) << std::endl;
+        return false;
+    }
+    char buffer[sizeof(struct dm_ioctl) + DM_NAME_LEN] = {};
+    auto io = reinterpret_cast<struct dm_ioctl*>(buffer);
+    io->version[0] = DM_VERSION_MAJOR;
+    io->version[1] = 0;
+    io->version[2] = 0;
+    io->data_size = sizeof(buffer);
+    io->data_start = sizeof(struct dm_ioctl);
+    strncpy(io->name, oldName.c_str(), sizeof(io->name) - 1);
+    strncpy(buffer + io->data_start, newName.c_str(), DM_NAME_LEN - 1);
+    if (ioctl(fd, DM_DEV_RENAME, io) != 0) {
+        std::cerr << "Unable to rename dm device " << oldName << " to " << newName << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Exchanges (or, with |rename|, moves) the extents and attributes of every pair in
+// |names| and commits all of them with one metadata write. No data is copied.
+int swapPartitions(PartitionBuilder& builder, const string& superPath, int slotValue,
+                   const std::vector<string>& names, bool rename) {
+    bool useDm = isBlockDevice(superPath);
+    std::vector<string> reload;
+    std::vector<std::pair<string, string>> renamed;
+    for (size_t i = 0; i + 1 < names.size(); i += 2) {
+        const auto& first = names[i];
+        const auto& second = names[i + 1];
+        TraceScope trace(rename ? "RenamePartition" : "SwapPartitions", first + " " + second);
+        auto a = builder->FindPartition(first);
+        auto b = builder->FindPartition(second);
+        if (a == nullptr) {
+            std::cerr << "Partition " << first << " does not exist" << std::endl;
+            return 1;
+        }
+        if (first == second) {
+            std::cerr << "Cannot " << (rename ? "rename " : "swap ") << first << " with itself" << std::endl;
+            return 1;
+        }
+        if (rename) {
+            if (b != nullptr ||
+                (useDm && android::dm::DeviceMapper::Instance().GetState(second) != android::dm::DmDeviceState::INVALID)) {
+                std::cerr << "Partition " << second << " already exists" << std::endl;
+                return 1;
+            }
+            b = builder->AddPartition(second, a->group_name(), a->attributes());
+            if (b == nullptr) {
+                std::cerr << "Failed to add partition " << second << std::endl;
+                return 1;
+            }
+            setExtents(b, cloneExtents(a));
+            builder->RemovePartition(first);
+            renamed.emplace_back(first, second);
+        } else {
+            if (b == nullptr) {
+                std::cerr << "Partition " << second << " does not exist" << std::endl;
+                return 1;
+            }
+            auto extentsA = cloneExtents(a);
+            auto attributesA = a->attributes();
+            setExtents(a, cloneExtents(b));
+            a->set_attributes(b->attributes());
+            setExtents(b, std::move(extentsA));
+            b->set_attributes(attributesA);
+            reload.push_back(first);
+            reload.push_back(second);
+        }
+        std::cout << (rename ? "Renaming " : "Swapping ") << first << (rename ? " -> " : " <-> ") << second << std::endl;
+    }
+    if (!checkGroupLimits(builder)) {
+        return 1;
+    }
+    auto metadata = exportMetadata(builder);
+    if (!metadata || !UpdateAllPartitionMetadata(superPath, *metadata.get(), slotValue)) {
+        std::cerr << "Failed to write partition table" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Committed " << names.size() / 2 << (rename ? " rename(s)" : " swap(s)") << std::endl;
+    if (!useDm) {
+        return 0;
+    }
+    // Swapped devices keep their names and get each other's tables; renamed devices
+    // already point at the right extents and only need their name changed.
+    bool ok = true;
+    std::vector<string> toMap;
+    reloadMappedPartitions(*metadata.get(), superPath, reload, &toMap);
+    std::vector<MapResult> results;
+    ok &= mapPartitions(*metadata.get(), superPath, toMap, &results);
+    for (const auto& [oldName, newName] : renamed) {
+        if (isMapped(oldName)) {
+            ok &= renameDmDevice(oldName, newName);
+        }
+    }
+    return ok ? 0 : 1;
+}
+static constexpr size_t kCloneWorkers = 4;
+static constexpr uint64_t kCloneChunkSize = 16 * 1024 * 1024;
+
+// A piece of a --clone that is contiguous on super in both partitions.
+struct CloneChunk {
+    uint64_t logical;
+    uint64_t source;
+    uint64_t destination;
+    uint64_t length;
+};
+
+bool isZeroBuffer(const uint8_t* data, size_t length) {
+    return length == 0 || (data[0] == 0 && memcmp(data, data + 1, length - 1) == 0);
+}
+
+// Makes [offset, offset + length) of super read back as zeroes without writing them
+// where possible: BLKZEROOUT on a block device, a hole in an image file.
+bool zeroOutRange(int fd, uint64_t offset, uint64_t length, bool blockDevice) {
+    if (blockDevice) {
+        uint64_t range[2] = {offset, length};
+        sIoThrottle.Acquire(length);
+        if (ioctl(fd, BLKZEROOUT, range) == 0) {
+            return true;
+        }
+    } else if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+        return true;
+    }
+    static const std::vector<uint8_t> zeroes(1024 * 1024);
+    while (length > 0) {
+        size_t n = std::min<uint64_t>(length, zeroes.size());
+        if (!throttledWriteAt(fd, zeroes.data(), n, offset)) {
+            std::cerr << "Write failed at " << offset << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+// Gives |destination| the extent layout of |source|: a ZeroExtent wherever |source|
+// has one and newly allocated space everywhere else, so zero extents are never copied.
+bool allocateCloneExtents(PartitionBuilder& builder, Partition* source, Partition* destination) {
+    if (!builder->ResizePartition(destination, source->BytesOnDisk())) {
+        return false;
+    }
+    auto allocated = cloneExtents(destination);
+    std::vector<std::unique_ptr<Extent>> extents;
+    size_t next = 0;
+    uint64_t used = 0;
+    for (const auto& extent : source->extents()) {
+        if (extent->AsLinearExtent() == nullptr) {
+            extents.push_back(std::make_unique<ZeroExtent>(extent->num_sectors()));
+            continue;
+        }
+        for (uint64_t sectors = extent->num_sectors(); sectors > 0;) {
+            auto linear = allocated[next]->AsLinearExtent();
+            uint64_t take = std::min(sectors, linear->num_sectors() - used);
+            extents.push_back(std::make_unique<LinearExtent>(take, linear->device_index(), linear->physical_sector() + used));
+            sectors -= take;
+            used += take;
+            if (used == linear->num_sectors()) {
+                next++;
+                used = 0;
+            }
+        }
+    }
+    setExtents(destination, std::move(extents));
+    return true;
+}
+
+// Pairs up the ranges of two partitions with the same layout and cuts them into chunks.
+bool planCloneChunks(const std::vector<PartitionRange>& source, const std::vector<PartitionRange>& destination,
+                     std::vector<CloneChunk>* chunks) {
+    uint64_t logical = 0;
+    for (size_t i = 0, j = 0; i < source.size() && j < destination.size();) {
+        const auto& from = source[i];
+        const auto& to = destination[j];
+        uint64_t end = std::min(from.logical + from.length, to.logical + to.length);
+        if (from.zero != to.zero) {
+            return false;
+        }
+        for (uint64_t done = 0; !from.zero && logical + done < end; done += kCloneChunkSize) {
+            chunks->push_back({logical + done, from.physical + (logical - from.logical) + done,
+                               to.physical + (logical - to.logical) + done,
+                               std::min(kCloneChunkSize, end - logical - done)});
+        }
+        logical = end;
+        i += logical == from.logical + from.length;
+        j += logical == to.logical + to.length;
+    }
+    return true;
+}
+
+struct CloneStats {
+    std::atomic<uint64_t> copied{0};
+    std::atomic<uint64_t> skipped{0};
+};
+
+// Image files: holes are found with SEEK_DATA and stay holes, data goes through
+// copy_file_range.
+bool cloneFileChunk(int fd, const CloneChunk& chunk, CloneStats* stats) {
+    uint64_t end = chunk.source + chunk.length;
+    for (uint64_t pos = chunk.source; pos < end;) {
+        off64_t data = lseek64(fd, pos, SEEK_DATA);
+        if (data < 0 && errno != ENXIO) {
+            data = pos;
+        }
+        uint64_t dataStart = data < 0 ? end : std::min<uint64_t>(data, end);
+        if (dataStart > pos) {
+            if (!zeroOutRange(fd, chunk.destination + (pos - chunk.source), dataStart - pos, false)) {
+                return false;
+            }
+            stats->skipped += dataStart - pos;
+        }
+        if (dataStart == end) {
+            break;
+        }
+        off64_t hole = lseek64(fd, dataStart, SEEK_HOLE);
+        uint64_t dataEnd = hole < 0 ? end : std::min<uint64_t>(hole, end);
+        bool zeroCopy = true;
+        if (!copyRange(fd, dataStart, fd, chunk.destination + (dataStart - chunk.source), dataEnd - dataStart, &zeroCopy)) {
+            return false;
+        }
+        stats->copied += dataEnd - dataStart;
+        pos = dataEnd;
+    }
+    return true;
+}
+
+// Block devices: read in large O_DIRECT requests and turn all-zero buffers into
+// BLKZEROOUT instead of writing them.
+bool cloneDeviceChunk(int fd, int directFd, const CloneChunk& chunk, CloneStats* stats) {
+    thread_local AlignedBuffer buffer = allocateAligned(kIoBufferSize);
+    if (!buffer) {
+        return false;
+    }
+    bool direct = directFd >= 0 && chunk.source % kDirectIoAlignment == 0 &&
+                  chunk.destination % kDirectIoAlignment == 0 && chunk.length % kDirectIoAlignment == 0;
+    int ioFd = direct ? directFd : fd;
+    for (uint64_t done = 0; done < chunk.length;) {
+        size_t n = std::min<uint64_t>(chunk.length - done, kIoBufferSize);
+        if (!throttledReadAt(ioFd, buffer.get(), n, chunk.source + done)) {
+            std::cerr << "Read failed at " << chunk.source + done << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (isZeroBuffer(buffer.get(), n)) {
+            if (!zeroOutRange(fd, chunk.destination + done, n, true)) {
+                return false;
+            }
+            stats->skipped += n;
+        } else {
+            if (!throttledWriteAt(ioFd, buffer.get(), n, chunk.destination + done)) {
+                std::cerr << "Write failed at " << chunk.destination + done << ": " << strerror(errno) << std::endl;
+                return false;
+            }
+            stats->copied += n;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// Compares a chunk of both partitions, returning the logical offset of the first
+// differing byte or chunk.length when they match.
+uint64_t compareCloneChunk(int fd, const CloneChunk& chunk, bool* ok) {
+    thread_local AlignedBuffer source = allocateAligned(kIoBufferSize);
+    thread_local AlignedBuffer destination = allocateAligned(kIoBufferSize);
+    if (!source || !destination) {
+        *ok = false;
+        return chunk.length;
+    }
+    for (uint64_t done = 0; done < chunk.length;) {
+        size_t n = std::min<uint64_t>(chunk.length - done, kIoBufferSize);
+        if (!throttledReadAt(fd, source.get(), n, chunk.source + done) ||
+            !throttledReadAt(fd, destination.get(), n, chunk.destination + done)) {
+            std::cerr << "Read failed: " << strerror(errno) << std::endl;
+            *ok = false;
+            return chunk.length;
+        }
+        if (memcmp(source.get(), destination.get(), n) != 0) {
+            size_t i = 0;
+            while (source[i] == destination[i]) {
+                i++;
+            }
+            return done + i;
+        }
+        done += n;
+    }
+    return chunk.length;
+}
+
+int clonePartition(PartitionBuilder& builder, const string& superPath, int slotValue, const string& groupValue,
+                   const string& sourceName, const string& destinationName, bool verify) {
+    auto source = builder->FindPartition(sourceName);
+    if (source == nullptr) {
+        std::cerr << "Partition " << sourceName << " does not exist" << std::endl;
+        return 1;
+    }
+    if (builder->FindPartition(destinationName) != nullptr) {
+        std::cerr << "Partition " << destinationName << " already exists." << std::endl;
+        return 1;
+    }
+    if (isBlockDevice(superPath) && isMapped(sourceName)) {
+        std::cerr << "Warning: " << sourceName << " is mapped, writes to it during the copy may be lost" << std::endl;
+    }
+    Partition* destination;
+    {
+        TraceScope trace("AddPartition", destinationName);
+        destination = builder->AddPartition(destinationName, groupValue, 0);
+        if (destination == nullptr) {
+            std::cerr << "Failed to add partition" << std::endl;
+            return 1;
+        }
+        if (!allocateCloneExtents(builder, source, destination)) {
+            std::cerr << "Not enough space to clone " << sourceName << std::endl;
+            return 1;
+        }
+    }
+    std::vector<PartitionRange> sourceRanges, destinationRanges;
+    std::vector<CloneChunk> chunks;
+    if (!getPartitionRanges(source, &sourceRanges) || !getPartitionRanges(destination, &destinationRanges) ||
+        !planCloneChunks(sourceRanges, destinationRanges, &chunks)) {
+        std::cerr << "Unable to plan the copy of " << sourceName << std::endl;
+        return 1;
+    }
+
+    android::base::unique_fd fd(open(superPath.c_str(), O_RDWR | O_CLOEXEC));
+    if (fd < 0) {
+        std::cerr << "Unable to open " << superPath << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    struct stat st;
+    bool blockDevice = fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
+    android::base::unique_fd directFd;
+    if (blockDevice) {
+        directFd.reset(open(superPath.c_str(), O_RDWR | O_DIRECT | O_CLOEXEC));
+    }
+
+    // The data is copied before the metadata is written, so an interrupted clone
+    // leaves no half-copied partition behind.
+    auto start = std::chrono::steady_clock::now();
+    CloneStats stats;
+    std::atomic<bool> ok{true};
+    {
+        TraceScope trace("CopyData", sourceName);
+        parallelFor(chunks.size(), kCloneWorkers, [&](size_t i) {
+            if (ok && !(blockDevice ? cloneDeviceChunk(fd, directFd, chunks[i], &stats)
+                                    : cloneFileChunk(fd, chunks[i], &stats))) {
+                ok = false;
+            }
+        });
+        if (ok && fsync(fd) != 0) {
+            std::cerr << "Unable to sync " << superPath << ": " << strerror(errno) << std::endl;
+            ok = false;
+        }
+    }
+    if (!ok) {
+        std::cerr << "Failed to copy " << sourceName << " to " << destinationName << std::endl;
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t zeroExtents = source->size() - source->BytesOnDisk();
+
+    if (verify) {
+        TraceScope trace("VerifyData", destinationName);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        std::atomic<uint64_t> mismatch{UINT64_MAX};
+        std::atomic<bool> readOk{true};
+        parallelFor(chunks.size(), kCloneWorkers, [&](size_t i) {
+            bool chunkOk = true;
+            uint64_t at = compareCloneChunk(fd, chunks[i], &chunkOk);
+            if (!chunkOk) {
+                readOk = false;
+            } else if (at < chunks[i].length) {
+                uint64_t logical = chunks[i].logical + at;
+                for (uint64_t prev = mismatch; logical < prev && !mismatch.compare_exchange_weak(prev, logical);) {
+                }
+            }
+        });
+        if (!readOk || mismatch != UINT64_MAX) {
+            if (mismatch != UINT64_MAX) {
+                std::cerr << "Verification failed: " << destinationName << " differs from " << sourceName
+                          << " at offset " << mismatch << std::endl;
+            }
+            return 1;
+        }
+        std::cout << "Verified " << destinationName << std::endl;
+    }
+
+    auto metadata = exportMetadata(builder);
+    if (!metadata || !UpdateAllPartitionMetadata(superPath, *metadata.get(), slotValue)) {
+        std::cerr << "Failed to write partition table" << std::endl;
+        return 1;
+    }
+    printf("Cloned %s to %s: %" PRIu64 " bytes copied, %" PRIu64 " bytes skipped, %.2f s, %.2f MB/s\n",
+           sourceName.c_str(), destinationName.c_str(), stats.copied.load(), stats.skipped + zeroExtents, seconds,
+           seconds > 0 ? (stats.copied + stats.skipped) / 1024.0 / 1024.0 / seconds : 0.0);
+    return 0;
+}
+
+// --sync-slot compares both sides in blocks of this size and rewrites only the
+// blocks that differ, merging neighbouring ones into one write.
+static constexpr uint64_t kSyncBlockSize = 64 * 1024;
+
+// A piece of --sync-slot that is contiguous on super on both sides. |zero| means the
+// source is a ZeroExtent there and the target has to read back as zeroes.
+struct SyncChunk {
+    uint64_t source;
+    uint64_t destination;
+    uint64_t length;
+    bool zero;
+};
+
+struct SyncStats {
+    std::atomic<uint64_t> scanned{0};
+    std::atomic<uint64_t> written{0};
+};
+
+// Pairs up the ranges of a source and a target of the same size. Fails where the
+// target has a ZeroExtent but the source has data, since nothing can be written there.
+bool planSyncChunks(const std::vector<PartitionRange>& source, const std::vector<PartitionRange>& target,
+                    std::vector<SyncChunk>* chunks) {
+    uint64_t logical = 0;
+    for (size_t i = 0, j = 0; i < source.size() && j < target.size();) {
+        const auto& from = source[i];
+        const auto& to = target[j];
+        uint64_t end = std::min(from.logical + from.length, to.logical + to.length);
+        if (to.zero && !from.zero) {
+            return false;
+        }
+        for (uint64_t done = 0; !to.zero && logical + done < end; done += kCloneChunkSize) {
+            chunks->push_back({from.physical + (logical - from.logical) + done,
+                               to.physical + (logical - to.logical) + done,
+                               std::min(kCloneChunkSize, end - logical - done), from.zero});
+        }
+        logical = end;
+        i += logical == from.logical + from.length;
+        j += logical == to.logical + to.length;
+    }
+    return true;
+}
+
+// Reads both sides of |chunk| and writes the runs of blocks that differ from the
+// source. With |dryRun| the runs are only counted.
+bool syncChunk(int fd, int directFd, bool blockDevice, const SyncChunk& chunk, bool dryRun, SyncStats* stats) {
+    thread_local AlignedBuffer source = allocateAligned(kIoBufferSize);
+    thread_local AlignedBuffer target = allocateAligned(kIoBufferSize);
+    if (!source || !target) {
+        return false;
+    }
+    bool direct = directFd >= 0 && chunk.source % kDirectIoAlignment == 0 &&
+                  chunk.destination % kDirectIoAlignment == 0 && chunk.length % kDirectIoAlignment == 0;
+    int ioFd = direct ? directFd : fd;
+    for (uint64_t done = 0; done < chunk.length;) {
+        size_t n = std::min<uint64_t>(chunk.length - done, kIoBufferSize);
+        if (chunk.zero) {
+            memset(source.get(), 0, n);
+        } else if (!throttledReadAt(ioFd, source.get(), n, chunk.source + done)) {
+            std::cerr << "Read failed at " << chunk.source + done << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (!throttledReadAt(ioFd, target.get(), n, chunk.destination + done)) {
+            std::cerr << "Read failed at " << chunk.destination + done << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        stats->scanned += n;
+        for (size_t block = 0; block < n;) {
+            size_t length = std::min<uint64_t>(n - block, kSyncBlockSize);
+            if (memcmp(source.get() + block, target.get() + block, length) == 0) {
+                block += length;
+                continue;
+            }
+            size_t runEnd = block + length;
+            while (runEnd < n) {
+                size_t next = std::min<uint64_t>(n - runEnd, kSyncBlockSize);
+                if (memcmp(source.get() + runEnd, target.get() + runEnd, next) == 0) {
+                    break;
+                }
+                runEnd += next;
+            }
+            uint64_t offset = chunk.destination + done + block;
+            if (!dryRun) {
+                bool ok = chunk.zero ? zeroOutRange(fd, offset, runEnd - block, blockDevice)
+                                     : throttledWriteAt(ioFd, source.get() + block, runEnd - block, offset);
+                if (!ok) {
+                    std::cerr << "Write failed at " << offset << ": " << strerror(errno) << std::endl;
+                    return false;
+                }
+            }
+            stats->written += runEnd - block;
+            block = runEnd;
+        }
+        done += n;
+    }
+    return true;
+}
+
+int syncSlot(PartitionBuilder& builder, const string& superPath, int slotValue, const string& fromSuffix,
+             const string& toSuffix, bool dryRun) {
+    if (fromSuffix == toSuffix) {
+        std::cerr << "Source and target suffix are the same" << std::endl;
+        return 1;
+    }
+    std::vector<std::pair<Partition*, Partition*>> pairs;
+    std::vector<string> resized;
+    for (const auto& groupName : builder->ListGroups()) {
+        for (auto source : builder->ListPartitionsInGroup(groupName)) {
+            const string& name = source->name();
+            if (!android::base::EndsWith(name, fromSuffix)) {
+                continue;
+            }
+            string targetName = name.substr(0, name.size() - fromSuffix.size()) + toSuffix;
+            auto target = builder->FindPartition(targetName);
+            TraceScope trace("PrepareTarget", targetName);
+            if (target == nullptr) {
+                // The target goes into the matching group of the other slot when there is one.
+                string targetGroup = groupName;
+                if (android::base::EndsWith(groupName, fromSuffix)) {
+                    string candidate = groupName.substr(0, groupName.size() - fromSuffix.size()) + toSuffix;
+                    if (builder->FindGroup(candidate) != nullptr) {
+                        targetGroup = candidate;
+                    }
+                }
+                target = builder->AddPartition(targetName, targetGroup, source->attributes());
+                if (target == nullptr || !allocateCloneExtents(builder, source, target)) {
+                    std::cerr << "Not enough space to create " << targetName << std::endl;
+                    return 1;
+                }
+                printf("Creating %s in %s\n", targetName.c_str(), targetGroup.c_str());
+            } else if (target->size() != source->size()) {
+                if (!builder->ResizePartition(target, source->size())) {
+                    std::cerr << "Not enough space to resize " << targetName << std::endl;
+                    return 1;
+                }
+                resized.push_back(targetName);
+                printf("Resizing %s to %" PRIu64 "\n", targetName.c_str(), source->size());
+            }
+            if (isBlockDevice(superPath) && isMapped(targetName)) {
+                std::cerr << "Warning: " << targetName << " is mapped, it changes under its users" << std::endl;
+            }
+            pairs.emplace_back(source, target);
+        }
+    }
+    if (pairs.empty()) {
+        std::cerr << "No partition ends in " << fromSuffix << std::endl;
+        return 1;
+    }
+
+    android::base::unique_fd fd(open(superPath.c_str(), (dryRun ? O_RDONLY : O_RDWR) | O_CLOEXEC));
+    if (fd < 0) {
+        std::cerr << "Unable to open " << superPath << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    struct stat st;
+    bool blockDevice = fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
+    android::base::unique_fd directFd;
+    if (blockDevice) {
+        directFd.reset(open(superPath.c_str(), (dryRun ? O_RDONLY : O_RDWR) | O_DIRECT | O_CLOEXEC));
+    }
+
+    // As with --clone, the data goes first: a target created here does not exist until
+    // the metadata is written after the copy.
+    auto start = std::chrono::steady_clock::now();
+    uint64_t scanned = 0, written = 0;
+    for (const auto& [source, target] : pairs) {
+        TraceScope trace("SyncData", target->name());
+        std::vector<PartitionRange> sourceRanges, targetRanges;
+        std::vector<SyncChunk> chunks;
+        if (!getPartitionRanges(source, &sourceRanges) || !getPartitionRanges(target, &targetRanges)) {
+            return 1;
+        }
+        if (!planSyncChunks(sourceRanges, targetRanges, &chunks)) {
+            std::cerr << target->name() << " has a zero extent where " << source->name()
+                      << " has data, remove it and sync again" << std::endl;
+            return 1;
+        }
+        SyncStats stats;
+        std::atomic<bool> ok{true};
+        parallelFor(chunks.size(), kCloneWorkers, [&](size_t i) {
+            if (ok && !syncChunk(fd, directFd, blockDevice, chunks[i], dryRun, &stats)) {
+                ok = false;
+            }
+        });
+        if (!ok) {
+            std::cerr << "Failed to sync " << source->name() << " to " << target->name() << std::endl;
+            return 1;
+        }
+        printf("%s -> %s: %" PRIu64 " bytes scanned, %" PRIu64 " bytes %s\n", source->name().c_str(),
+               target->name().c_str(), stats.scanned.load(), stats.written.load(), dryRun ? "differ" : "written");
+        scanned += stats.scanned;
+        written += stats.written;
+    }
+    if (!dryRun && fsync(fd) != 0) {
+        std::cerr << "Unable to sync " << superPath << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Synced %zu partition(s) from %s to %s: %" PRIu64 " bytes scanned, %" PRIu64 " bytes %s, %.2f s, %.2f MB/s\n",
+           pairs.size(), fromSuffix.c_str(), toSuffix.c_str(), scanned, written, dryRun ? "differ" : "written",
+           seconds, seconds > 0 ? scanned / 1024.0 / 1024.0 / seconds : 0.0);
+    if (dryRun) {
+        return 0;
+    }
+
+    auto metadata = exportMetadata(builder);
+    if (!metadata || !UpdateAllPartitionMetadata(superPath, *metadata.get(), slotValue)) {
+        std::cerr << "Failed to write partition table" << std::endl;
+        return 1;
+    }
+    if (!isBlockDevice(superPath)) {
+        return 0;
+    }
+    std::vector<string> toMap;
+    bool ok = reloadMappedPartitions(*metadata.get(), superPath, resized, &toMap);
+    std::vector<MapResult> mapped;
+    ok &= mapPartitions(*metadata.get(), superPath, toMap, &mapped);
+    return ok ? 0 : 1;
+}
+
+static constexpr uint64_t kDiscardChunkSize = 32 * 1024 * 1024;
+
+// Byte ranges of super (offset, length) that hold the linear extents of |partition|.
+std::vector<std::pair<uint64_t, uint64_t>> linearRegions(const Partition* partition) {
+    std::vector<std::pair<uint64_t, uint64_t>> regions;
+    for (const auto& extent : partition->extents()) {
+        auto linear = extent->AsLinearExtent();
+        if (linear != nullptr) {
+            regions.emplace_back(linear->physical_sector() * LP_SECTOR_SIZE, linear->num_sectors() * LP_SECTOR_SIZE);
+        }
+    }
+    return regions;
+}
+
+// The parts of |regions| that no range of |keep| overlaps.
+std::vector<std::pair<uint64_t, uint64_t>> subtractRegions(std::vector<std::pair<uint64_t, uint64_t>> regions,
+                                                           std::vector<std::pair<uint64_t, uint64_t>> keep) {
+    std::sort(regions.begin(), regions.end());
+    std::sort(keep.begin(), keep.end());
+    std::vector<std::pair<uint64_t, uint64_t>> result;
+    size_t k = 0;
+    for (auto [offset, length] : regions) {
+        uint64_t end = offset + length;
+        while (k < keep.size() && keep[k].first + keep[k].second <= offset) {
+            k++;
+        }
+        for (size_t i = k; i < keep.size() && keep[i].first < end; i++) {
+            if (keep[i].first > offset) {
+                result.emplace_back(offset, keep[i].first - offset);
+            }
+            offset = std::max(offset, keep[i].first + keep[i].second);
+        }
+        if (offset < end) {
+            result.emplace_back(offset, end - offset);
+        }
+    }
+    return result;
+}
+
+// Tells the storage that |regions| of super hold nothing anymore: BLKDISCARD, or
+// BLKZEROOUT where the device cannot discard, or holes in an image file. Requests are
+// at most kDiscardChunkSize so other I/O to the device is not stuck behind them.
+bool discardRegions(const string& superPath, const std::vector<std::pair<uint64_t, uint64_t>>& regions) {
+    TraceScope trace("DiscardRegions");
+    android::base::unique_fd fd(open(superPath.c_str(), O_RDWR | O_CLOEXEC));
+    if (fd < 0) {
+        std::cerr << "Unable to open " << superPath << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    struct stat st;
+    bool blockDevice = fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
+    const char* method = blockDevice ? "BLKDISCARD" : "punch hole";
+    bool zeroOut = false;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t total = 0;
+    for (auto [offset, length] : regions) {
+        for (uint64_t done = 0; done < length;) {
+            uint64_t range[2] = {offset + done, std::min(length - done, kDiscardChunkSize)};
+            int rv;
+            if (!blockDevice) {
+                rv = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, range[0], range[1]);
+            } else if (!zeroOut) {
+                rv = ioctl(fd, BLKDISCARD, range);
+                if (rv != 0 && (errno == EOPNOTSUPP || errno == ENOTTY)) {
+                    zeroOut = true;
+                    method = "BLKZEROOUT";
+                    continue;
+                }
+            } else {
+                rv = ioctl(fd, BLKZEROOUT, range);
+            }
+            if (rv != 0) {
+                std::cerr << method << " failed at " << range[0] << ": " << strerror(errno) << std::endl;
+                return false;
+            }
+            done += range[1];
+            total += range[1];
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Discarded %" PRIu64 " bytes in %zu range(s) with %s, %.2f s\n", total, regions.size(), method, seconds);
+    return true;
+}
+
+int wipePartition(const MetadataIndex& index, const string& superPath, const string& partName) {
+    auto partition = index.FindPartition(partName);
+    if (partition == nullptr) {
+        std::cerr << "Partition " << partName << " does not exist" << std::endl;
+        return 1;
+    }
+    if (isBlockDevice(superPath) && isMapped(partName)) {
+        std::cerr << "Partition " << partName << " is mapped, unmap it before wiping it" << std::endl;
+        return 1;
+    }
+    std::vector<PartitionRange> ranges;
+    if (!getPartitionRanges(index.metadata(), *partition, &ranges)) {
+        return 1;
+    }
+    std::vector<std::pair<uint64_t, uint64_t>> regions;
+    for (const auto& range : ranges) {
+        if (!range.zero) {
+            regions.emplace_back(range.physical, range.length);
+        }
+    }
+    return discardRegions(superPath, regions) ? 0 : 1;
+}
+
+// Where the superblocks of the filesystems --shrink-to-fit understands live. ext4 is
+// parsed by libext4_utils; erofs has no library here, so its two fields are read
+// directly.
+static constexpr uint64_t kSuperblockOffset = 1024;
+static constexpr uint32_t kErofsMagic = 0xe0f5e1e2;
+static constexpr size_t kErofsBlockSizeBitsOffset = 12;
+static constexpr size_t kErofsBlocksOffset = 36;
+// An AVB footer in the last 64 bytes means the hashtree and vbmeta follow the
+// filesystem, and they are not part of the size the superblock reports.
+static constexpr size_t kAvbFooterSize = 64;
+static constexpr char kAvbFooterMagic[] = "AVBf";
+
+// Reads the superblock from the start of the partition and returns the filesystem
+// type and the bytes it covers, or false if the contents are not recognized.
+bool readFilesystemSize(ExtentReader& reader, uint64_t partitionSize, string* type, uint64_t* size) {
+    uint8_t superblock[4096];
+    if (partitionSize < kSuperblockOffset + sizeof(superblock) ||
+        !reader.Read(kSuperblockOffset, superblock, sizeof(superblock))) {
+        return false;
+    }
+    uint8_t footer[kAvbFooterSize];
+    if (reader.Read(partitionSize - sizeof(footer), footer, sizeof(footer)) &&
+        memcmp(footer, kAvbFooterMagic, strlen(kAvbFooterMagic)) == 0) {
+        *type = "avb";
+        return false;
+    }
+    fs_info info = {};
+    if (ext4_parse_sb(reinterpret_cast<ext4_super_block*>(superblock), &info) == 0 && info.len > 0) {
+        *type = "ext4";
+        *size = info.len;
+        return true;
+    }
+    uint32_t magic, blocks;
+    memcpy(&magic, superblock, sizeof(magic));
+    memcpy(&blocks, superblock + kErofsBlocksOffset, sizeof(blocks));
+    uint8_t blockSizeBits = superblock[kErofsBlockSizeBitsOffset];
+    if (magic == kErofsMagic && blockSizeBits >= 9 && blockSizeBits <= 16 && blocks > 0) {
+        *type = "erofs";
+        *size = uint64_t(blocks) << blockSizeBits;
+        return true;
+    }
+    return false;
+}
+
+// Shrinks every partition of |names| (or all of super with |all|) to the end of its
+// filesystem rounded up to the super alignment, with one metadata write.
+int shrinkToFit(PartitionBuilder& builder, const string& superPath, int slotValue, std::vector<string> names,
+                bool all, bool dryRun, bool discard) {
+    auto metadata = exportMetadata(builder);
+    if (!metadata || metadata->block_devices.empty()) {
+        std::cerr << "Failed to export metadata" << std::endl;
+        return 1;
+    }
+    uint64_t alignment = std::max<uint64_t>(metadata->block_devices[0].alignment,
+                                            metadata->geometry.logical_block_size);
+    if (all) {
+        names.clear();
+        for (const auto& groupName : builder->ListGroups()) {
+            for (const auto& partition : builder->ListPartitionsInGroup(groupName)) {
+                names.push_back(partition->name());
+            }
+        }
+    }
+
+    std::vector<string> shrunk;
+    std::vector<std::pair<uint64_t, uint64_t>> released;
+    uint64_t reclaimed = 0;
+    for (const auto& partName : names) {
+        auto partition = builder->FindPartition(partName);
+        if (partition == nullptr) {
+            std::cerr << "Partition " << partName << " does not exist" << std::endl;
+            return 1;
+        }
+        uint64_t size = partition->size();
+        std::vector<PartitionRange> ranges;
+        ExtentReader reader;
+        string type = "unknown";
+        uint64_t fsSize = 0;
+        if (!getPartitionRanges(partition, &ranges) || !reader.Open(superPath, std::move(ranges))) {
+            return 1;
+        }
+        if (!readFilesystemSize(reader, size, &type, &fsSize)) {
+            printf("%s: %s contents, skipped\n", partName.c_str(), type == "avb" ? "AVB footer after the" : "unrecognized");
+            continue;
+        }
+        uint64_t target = (fsSize + alignment - 1) / alignment * alignment;
+        if (fsSize > size) {
+            std::cerr << partName << ": " << type << " filesystem claims " << fsSize << " bytes, more than the "
+                      << size << " byte partition" << std::endl;
+            return 1;
+        }
+        if (target >= size) {
+            printf("%s: %s, %" PRIu64 " bytes, already fits\n", partName.c_str(), type.c_str(), size);
+            continue;
+        }
+        auto before = linearRegions(partition);
+        {
+            TraceScope trace("ResizePartition", partName);
+            if (!builder->ResizePartition(partition, target)) {
+                std::cerr << "Unable to shrink " << partName << std::endl;
+                return 1;
+            }
+        }
+        auto regions = subtractRegions(before, linearRegions(partition));
+        released.insert(released.end(), regions.begin(), regions.end());
+        reclaimed += size - target;
+        shrunk.push_back(partName);
+        printf("%s: %s, filesystem %" PRIu64 " bytes, %" PRIu64 " -> %" PRIu64 ", reclaimed %" PRIu64 "\n",
+               partName.c_str(), type.c_str(), fsSize, size, target, size - target);
+    }
+    printf("Reclaimed %" PRIu64 " bytes from %zu partition(s)%s\n", reclaimed, shrunk.size(),
+           dryRun ? ", dry run, nothing was written" : "");
+    if (dryRun || shrunk.empty()) {
+        return 0;
+    }
+
+    metadata = exportMetadata(builder);
+    if (!metadata || !UpdateAllPartitionMetadata(superPath, *metadata.get(), slotValue)) {
+        std::cerr << "Failed to write partition table" << std::endl;
+        return 1;
+    }
+    bool reloaded = true;
+    bool ok = true;
+    if (isBlockDevice(superPath)) {
+        std::vector<string> toMap;
+        reloaded = reloadMappedPartitions(*metadata.get(), superPath, shrunk, &toMap);
+        std::vector<MapResult> mapped;
+        ok = mapPartitions(*metadata.get(), superPath, toMap, &mapped);
+    }
+    if (discard && !released.empty()) {
+        if (!reloaded) {
+            std::cerr << "Not discarding: a partition is still mapped with its old size" << std::endl;
+            return 1;
+        }
+        ok &= discardRegions(superPath, released);
+    }
+    return ok ? 0 : 1;
+}
+
+// A --backup-metadata file is the metadata area of super byte for byte: the reserved
+// bytes, both geometry copies and the primary and backup copy of every slot, so
+// ReadMetadata parses it like super itself. A text trailer follows with the extents
+// each partition owned, which --restore-metadata checks against the current tables.
+static constexpr const char* kMetadataBackupMagic = "# lptools metadata backup";
+
+// One linear extent of super as [start, end) sectors and the partition it belongs to.
+struct OwnedRegion {
+    string partition;
+    uint64_t start;
+    uint64_t end;
+};
+
+uint64_t metadataAreaSize(const LpMetadataGeometry& geometry) {
+    return LP_PARTITION_RESERVED_BYTES + 2 * LP_METADATA_GEOMETRY_SIZE +
+           2 * uint64_t(geometry.metadata_max_size) * geometry.metadata_slot_count;
+}
+
+// The primary geometry of |fd|. Its checksum is left to liblp, which reads it again
+// before any write.
+bool readGeometry(int fd, LpMetadataGeometry* geometry) {
+    return android::base::ReadFullyAtOffset(fd, geometry, sizeof(*geometry), LP_PARTITION_RESERVED_BYTES) &&
+           geometry->magic == LP_METADATA_GEOMETRY_MAGIC && geometry->struct_size == sizeof(*geometry) &&
+           geometry->metadata_slot_count > 0;
+}
+
+std::vector<OwnedRegion> ownedRegions(const LpMetadata& metadata) {
+    std::vector<OwnedRegion> owned;
+    for (const auto& partition : metadata.partitions) {
+        for (uint32_t i = 0; i < partition.num_extents; i++) {
+            const auto& extent = metadata.extents[partition.first_extent_index + i];
+            if (extent.target_type == LP_TARGET_TYPE_LINEAR && extent.target_source == 0) {
+                owned.push_back({GetPartitionName(partition), extent.target_data,
+                                 extent.target_data + extent.num_sectors});
+            }
+        }
+    }
+    return owned;
+}
+
+int backupMetadata(const string& superPath, const string& outPath) {
+    TraceScope trace("BackupMetadata");
+    auto start = std::chrono::steady_clock::now();
+    android::base::unique_fd fd(open(superPath.c_str(), O_RDONLY | O_CLOEXEC));
+    LpMetadataGeometry geometry;
+    if (fd < 0 || !readGeometry(fd, &geometry)) {
+        std::cerr << "Unable to read the metadata geometry of " << superPath << std::endl;
+        return 1;
+    }
+    string content(metadataAreaSize(geometry), '\0');
+    if (!android::base::ReadFullyAtOffset(fd, content.data(), content.size(), 0)) {
+        std::cerr << "Unable to read " << superPath << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    content += android::base::StringPrintf("%s\nslots %u\n", kMetadataBackupMagic, geometry.metadata_slot_count);
+    SuperPartitionOpener opener(superPath);
+    uint32_t valid = 0;
+    size_t extents = 0;
+    for (uint32_t slot = 0; slot < geometry.metadata_slot_count; slot++) {
+        auto metadata = ReadMetadata(opener, superPath, slot);
+        if (!metadata) {
+            std::cerr << "Warning: metadata slot " << slot << " is unreadable and will not be restored" << std::endl;
+            continue;
+        }
+        valid++;
+        content += android::base::StringPrintf("slot %u %zu\n", slot, metadata->partitions.size());
+        for (const auto& region : ownedRegions(*metadata)) {
+            content += android::base::StringPrintf("extent %u %s %" PRIu64 " %" PRIu64 "\n", slot,
+                                                   region.partition.c_str(), region.start, region.end);
+            extents++;
+        }
+    }
+    if (valid == 0) {
+        std::cerr << "No readable metadata slot in " << superPath << std::endl;
+        return 1;
+    }
+
+    string tmpPath = outPath + ".tmp";
+    android::base::unique_fd out(open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (out < 0 || !android::base::WriteStringToFd(content, out) || fsync(out) != 0 ||
+        rename(tmpPath.c_str(), outPath.c_str()) != 0) {
+        std::cerr << "Unable to write " << outPath << ": " << strerror(errno) << std::endl;
+        unlink(tmpPath.c_str());
+        return 1;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("Saved %u of %u metadata slot(s) and %zu extent(s) to %s, %.1f ms\n", valid,
+           geometry.metadata_slot_count, extents, outPath.c_str(), ms);
+    return 0;
+}
+
+// Reads the trailer of a backup: the slots it holds and the extents each partition
+// owned in any of them when it was taken.
+bool readBackupTrailer(const string& content, const LpMetadataGeometry& geometry, std::set<uint32_t>* slots,
+                       std::vector<OwnedRegion>* owned) {
+    uint64_t offset = metadataAreaSize(geometry);
+    if (content.size() <= offset || content.compare(offset, strlen(kMetadataBackupMagic), kMetadataBackupMagic) != 0) {
+        return false;
+    }
+    for (const auto& line : android::base::Split(content.substr(offset), "\n")) {
+        auto words = splitLine(line);
+        uint32_t slot;
+        if (words.size() == 3 && words[0] == "slot" && android::base::ParseUint(words[1], &slot) &&
+            slot < geometry.metadata_slot_count) {
+            slots->insert(slot);
+        } else if (words.size() == 5 && words[0] == "extent") {
+            OwnedRegion region = {words[2], 0, 0};
+            if (!android::base::ParseUint(words[3], &region.start) ||
+                !android::base::ParseUint(words[4], &region.end) || region.end <= region.start) {
+                return false;
+            }
+            owned->push_back(region);
+        }
+    }
+    return !slots->empty();
+}
+
+int restoreMetadata(const string& superPath, int slotValue, const string& backupPath, bool dryRun) {
+    TraceScope trace("RestoreMetadata");
+    auto start = std::chrono::steady_clock::now();
+    string content;
+    LpMetadataGeometry geometry, current;
+    android::base::unique_fd backupFd(open(backupPath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (backupFd < 0 || !readGeometry(backupFd, &geometry) ||
+        !android::base::ReadFileToString(backupPath, &content)) {
+        std::cerr << backupPath << " is not a metadata backup" << std::endl;
+        return 1;
+    }
+    std::set<uint32_t> slots;
+    std::vector<OwnedRegion> backupOwned;
+    if (!readBackupTrailer(content, geometry, &slots, &backupOwned)) {
+        std::cerr << backupPath << " has no valid lptools trailer" << std::endl;
+        return 1;
+    }
+    android::base::unique_fd superFd(open(superPath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (superFd < 0 || !readGeometry(superFd, &current)) {
+        std::cerr << "Unable to read the metadata geometry of " << superPath << std::endl;
+        return 1;
+    }
+    superFd.reset();
+    if (memcmp(&geometry, &current, sizeof(geometry)) != 0) {
+        std::cerr << "The geometry of " << superPath << " differs from the backup, refusing to restore" << std::endl;
+        return 1;
+    }
+
+    SuperPartitionOpener backupOpener(backupPath);
+    SuperPartitionOpener opener(superPath);
+    std::map<uint32_t, std::unique_ptr<LpMetadata>> restored, onDisk;
+    for (uint32_t slot : slots) {
+        restored[slot] = ReadMetadata(backupOpener, backupPath, slot);
+        if (!restored[slot]) {
+            std::cerr << "Metadata slot " << slot << " of " << backupPath << " is corrupt" << std::endl;
+            return 1;
+        }
+    }
+    for (uint32_t slot = 0; slot < current.metadata_slot_count; slot++) {
+        onDisk[slot] = ReadMetadata(opener, superPath, slot);
+    }
+
+    // Space a partition gained after the backup may hold data by now. Restoring a
+    // table that hands any of it to another partition would expose or corrupt it.
+    std::map<string, std::vector<std::pair<uint64_t, uint64_t>>> ownedBefore;
+    for (const auto& region : backupOwned) {
+        ownedBefore[region.partition].emplace_back(region.start, region.end - region.start);
+    }
+    for (const auto& [slot, metadata] : onDisk) {
+        if (!metadata) {
+            continue;
+        }
+        for (const auto& region : ownedRegions(*metadata)) {
+            auto gained = subtractRegions({{region.start, region.end - region.start}}, ownedBefore[region.partition]);
+            for (const auto& [gainedStart, gainedLength] : gained) {
+                for (const auto& other : backupOwned) {
+                    if (other.start < gainedStart + gainedLength && gainedStart < other.end) {
+                        std::cerr << "Refusing to restore: " << region.partition << " was given sectors "
+                                  << std::max(other.start, gainedStart) << "-"
+                                  << std::min(other.end, gainedStart + gainedLength) << " after the backup, and "
+                                  << other.partition << " would own them again" << std::endl;
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+
+    opener.set_defer_sync(true);
+    size_t written = 0;
+    for (const auto& [slot, metadata] : restored) {
+        if (onDisk[slot] && metadataEquals(*onDisk[slot], *metadata)) {
+            std::cout << "Metadata slot " << slot << " already matches the backup" << std::endl;
+            continue;
+        }
+        printf("%s metadata slot %u: %zu partition(s), %zu group(s)\n", dryRun ? "Would restore" : "Restoring",
+               slot, metadata->partitions.size(), metadata->groups.size());
+        if (!dryRun && !UpdatePartitionTable(opener, superPath, *metadata, slot)) {
+            std::cerr << "Failed to write metadata slot " << slot << std::endl;
+            return 1;
+        }
+        written++;
+    }
+    if (dryRun || written == 0) {
+        return 0;
+    }
+    android::base::unique_fd fd(opener.Open(superPath, O_RDWR));
+    if (fd < 0 || fsync(fd) != 0) {
+        std::cerr << "Unable to sync " << superPath << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("Restored %zu metadata slot(s) from %s in %.1f ms\n", written, backupPath.c_str(), ms);
+
+    // Mapped partitions of the active slot follow the restored tables.
+    auto active = restored.find(slotValue);
+    if (active == restored.end()) {
+        return 0;
+    }
+    std::vector<string> names;
+    for (const auto& partition : active->second->partitions) {
+        names.push_back(GetPartitionName(partition));
+    }
+    if (!isBlockDevice(superPath)) {
+        return 0;
+    }
+    if (onDisk[slotValue]) {
+        for (const auto& partition : onDisk[slotValue]->partitions) {
+            string name = GetPartitionName(partition);
+            if (std::find(names.begin(), names.end(), name) == names.end() && isMapped(name)) {
+                std::cerr << "Warning: " << name << " is still mapped but not part of the restored tables" << std::endl;
+            }
+        }
+    }
+    std::vector<string> toMap;
+    bool ok = reloadMappedPartitions(*active->second, superPath, names, &toMap);
+    std::vector<MapResult> mapped;
+    ok &= mapPartitions(*active->second, superPath, toMap, &mapped);
+    return ok ? 0 : 1;
+}
+
+// Fills |data| with [offset, offset + length) of the expanded image. DONT_CARE reads
+// back as zeroes, as it does after simg2img.
+bool readSparseRange(const PartitionImage& image, uint64_t offset, uint8_t* data, uint64_t length) {
+    memset(data, 0, length);
+    for (const auto& span : image.spans) {
+        uint64_t start = std::max(span.logical, offset);
+        uint64_t end = std::min(span.logical + span.length, offset + length);
+        if (start >= end) {
+            continue;
+        }
+        if (!span.isFill) {
+            if (!android::base::ReadFullyAtOffset(image.fd, data + (start - offset), end - start,
+                                                  span.fileOffset + (start - span.logical))) {
+                return false;
+            }
+            continue;
+        }
+        for (uint64_t pos = start; pos < end; pos++) {
+            data[pos - offset] = reinterpret_cast<const uint8_t*>(&span.fill)[(pos - span.logical) % sizeof(span.fill)];
+        }
+    }
+    return true;
+}
+
+bool isSparseImage(const string& path) {
+    android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    uint32_t magic = 0;
+    return fd >= 0 && pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == SPARSE_HEADER_MAGIC;
+}
+
+bool SparseSuperImage::Open(const string& path) {
+    TraceScope trace("OpenSparseSuper");
+    image_path_ = path;
+    PartitionImage image;
+    image.fd.reset(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    SparseImageHeader header;
+    std::vector<SparseChunk> chunks;
+    if (image.fd < 0 || !readSparseChunks(image.fd, path, &header, &chunks) || !readSparseSpans(path, &image)) {
+        std::cerr << "Unable to open sparse image " << path << std::endl;
+        return false;
+    }
+    // Checksums cover the expanded image, so changing a block in place would leave
+    // them wrong.
+    bool hasCrc = std::any_of(chunks.begin(), chunks.end(),
+                              [](const SparseChunk& chunk) { return chunk.type == kSparseChunkCrc32; });
+    if (header.checksum != 0 || hasCrc) {
+        std::cerr << "Error: " << path << " carries CRC32 checksums, expand it with simg2img first." << std::endl;
+        return false;
+    }
+    // The geometry says how large the metadata area is; everything after it belongs
+    // to partitions and is never expanded.
+    std::vector<uint8_t> geometryBlock(LP_METADATA_GEOMETRY_SIZE);
+    LpMetadataGeometry geometry;
+    if (!readSparseRange(image, LP_PARTITION_RESERVED_BYTES, geometryBlock.data(), geometryBlock.size())) {
+        return false;
+    }
+    memcpy(&geometry, geometryBlock.data(), sizeof(geometry));
+    if (geometry.magic != LP_METADATA_GEOMETRY_MAGIC) {
+        std::cerr << path << " has no logical partition metadata" << std::endl;
+        return false;
+    }
+    block_size_ = header.blockSize;
+    head_size_ = (metadataAreaSize(geometry) + block_size_ - 1) / block_size_ * block_size_;
+    if (head_size_ > image.size) {
+        std::cerr << "The metadata area of " << path << " is larger than the image" << std::endl;
+        return false;
+    }
+    original_head_.resize(head_size_);
+    if (!readSparseRange(image, 0, original_head_.data(), head_size_)) {
+        std::cerr << "Unable to read " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // A memfd of the full size, holding only the metadata area, stands in for super.
+    // liblp sees a plain file of the size the tables describe.
+    memfd_.reset(syscall(__NR_memfd_create, "lptools-super", MFD_CLOEXEC));
+    if (memfd_ < 0 || ftruncate(memfd_, image.size) != 0 ||
+        !android::base::WriteFullyAtOffset(memfd_, original_head_.data(), head_size_, 0)) {
+        std::cerr << "Unable to stage the metadata of " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    memfd_path_ = "/proc/self/fd/" + std::to_string(memfd_.get());
+    return true;
+}
+
+// Writes the metadata area back. Changed blocks stored in RAW chunks are overwritten
+// where they are. FILL and DONT_CARE chunks holding changed blocks are split so those
+// blocks get RAW chunks; the file only grows or shrinks at its start, by inserting or
+// collapsing whole filesystem blocks, so the partition data after it is never copied.
+// Not crash-safe: dying between resizing the file and writing its new start leaves
+// the image corrupt.
+bool SparseSuperImage::Commit() {
+    std::vector<uint8_t> head(head_size_);
+    if (!android::base::ReadFullyAtOffset(memfd_, head.data(), head_size_, 0)) {
+        std::cerr << "Unable to read the staged metadata: " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (memcmp(head.data(), original_head_.data(), head_size_) == 0) {
+        return true;
+    }
+    TraceScope trace("CommitSparseSuper");
+    android::base::unique_fd fd(open(image_path_.c_str(), O_RDWR | O_CLOEXEC));
+    SparseImageHeader header;
+    std::vector<SparseChunk> chunks;
+    if (fd < 0 || !readSparseChunks(fd, image_path_, &header, &chunks)) {
+        std::cerr << "Unable to reopen " << image_path_ << std::endl;
+        return false;
+    }
+    auto changed = [&](uint64_t block) {
+        uint64_t offset = block * block_size_;
+        return offset < head_size_ && memcmp(head.data() + offset, original_head_.data() + offset, block_size_) != 0;
+    };
+
+    // Everything up to the last chunk that has to be split is encoded again.
+    uint64_t headBlocks = head_size_ / block_size_;
+    size_t rewritten = 0;
+    for (size_t i = 0; i < chunks.size() && chunks[i].block < headBlocks; i++) {
+        if (chunks[i].type == kSparseChunkRaw) {
+            continue;
+        }
+        for (uint64_t block = chunks[i].block; block < chunks[i].block + chunks[i].blocks; block++) {
+            if (changed(block)) {
+                rewritten = i + 1;
+                break;
+            }
+        }
+    }
+
+    // Any extension of the file header from an earlier commit is dropped here and
+    // sized again below.
+    std::vector<uint8_t> prefix(sizeof(header));
+    uint32_t newChunks = 0;
+    auto addChunk = [&](uint16_t type, uint32_t blocks, const void* data, size_t size) {
+        std::vector<uint8_t> chunkHeader(header.chunkHeaderSize);
+        SparseChunkHeader chunk = {type, 0, blocks, uint32_t(header.chunkHeaderSize + size)};
+        memcpy(chunkHeader.data(), &chunk, sizeof(chunk));
+        prefix.insert(prefix.end(), chunkHeader.begin(), chunkHeader.end());
+        prefix.insert(prefix.end(), static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size);
+        newChunks++;
+    };
+    for (size_t i = 0; i < rewritten; i++) {
+        const auto& chunk = chunks[i];
+        if (chunk.type == kSparseChunkRaw) {
+            // Lies before a chunk inside the metadata area, so all of it is staged.
+            addChunk(kSparseChunkRaw, chunk.blocks, head.data() + chunk.block * block_size_,
+                     uint64_t(chunk.blocks) * block_size_);
+            continue;
+        }
+        if (chunk.type == kSparseChunkCrc32) {
+            continue;
+        }
+        // Runs of changed blocks become RAW, the rest keeps the type of the chunk.
+        uint64_t end = chunk.block + chunk.blocks;
+        for (uint64_t block = chunk.block; block < end;) {
+            bool raw = changed(block);
+            uint64_t runEnd = block + 1;
+            while (runEnd < end && changed(runEnd) == raw) {
+                runEnd++;
+            }
+            if (raw) {
+                addChunk(kSparseChunkRaw, runEnd - block, head.data() + block * block_size_,
+                         (runEnd - block) * block_size_);
+            } else {
+                addChunk(chunk.type, runEnd - block, &chunk.fill, chunk.type == kSparseChunkFill ? sizeof(chunk.fill) : 0);
+            }
+            block = runEnd;
+        }
+    }
+
+    int64_t shift = 0;
+    if (rewritten > 0) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            std::cerr << "Unable to stat " << image_path_ << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        // Files can only grow or shrink in the middle by whole filesystem blocks. The
+        // file header pads the new start to a size that allows it: its size is part of
+        // the format, and readers skip what they do not know.
+        uint64_t oldSize = chunks[rewritten - 1].offset + chunks[rewritten - 1].size;
+        int64_t fsBlock = st.st_blksize;
+        int64_t padding = ((int64_t(oldSize) - int64_t(prefix.size())) % fsBlock + fsBlock) % fsBlock;
+        if (sizeof(header) + padding > UINT16_MAX) {
+            std::cerr << "Error: Unable to align the new chunks of " << image_path_ << ", expand it with simg2img first."
+                      << std::endl;
+            return false;
+        }
+        prefix.insert(prefix.begin() + sizeof(header), padding, 0);
+        header.fileHeaderSize = sizeof(header) + padding;
+        shift = int64_t(prefix.size()) - int64_t(oldSize);
+        int rv = 0;
+        if (shift > 0) {
+            rv = fallocate(fd, FALLOC_FL_INSERT_RANGE, oldSize / fsBlock * fsBlock, shift);
+        } else if (shift < 0) {
+            rv = fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, prefix.size() / fsBlock * fsBlock, -shift);
+        }
+        if (rv != 0) {
+            std::cerr << "Error: Unable to resize the chunks of " << image_path_ << " in place (" << strerror(errno)
+                      << "), expand it with simg2img first." << std::endl;
+            return false;
+        }
+        header.totalChunks = header.totalChunks - rewritten + newChunks;
+        memcpy(prefix.data(), &header, sizeof(header));
+        if (!android::base::WriteFullyAtOffset(fd, prefix.data(), prefix.size(), 0)) {
+            std::cerr << "Unable to write " << image_path_ << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
+
+    uint64_t written = rewritten > 0 ? prefix.size() : 0;
+    for (size_t i = rewritten; i < chunks.size() && chunks[i].block < headBlocks; i++) {
+        const auto& chunk = chunks[i];
+        for (uint64_t block = chunk.block; chunk.type == kSparseChunkRaw && block < chunk.block + chunk.blocks; block++) {
+            if (!changed(block)) {
+                continue;
+            }
+            uint64_t offset = chunk.offset + shift + header.chunkHeaderSize + (block - chunk.block) * block_size_;
+            if (!android::base::WriteFullyAtOffset(fd, head.data() + block * block_size_, block_size_, offset)) {
+                std::cerr << "Unable to write " << image_path_ << ": " << strerror(errno) << std::endl;
+                return false;
+            }
+            written += block_size_;
+        }
+    }
+    if (fsync(fd) != 0) {
+        std::cerr << "Unable to sync " << image_path_ << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    printf("Updated the metadata of sparse image %s in place, %" PRIu64 " bytes written, %zu chunk(s) re-encoded\n",
+           image_path_.c_str(), written, rewritten);
+    return true;
+}
+
+string detectGroup(const MetadataIndex& index, const string& suffix) {
+    auto system = index.FindPartition("system" + suffix);
+    return system != nullptr ? index.GroupName(*system) : "";
+}
+
+int createPartition(PartitionBuilder& builder, const string& superPath, int slotValue,
+                    const string& groupValue, const string& partName, uint64_t partitionSize, AllocPolicy policy) {
+    std::cout << "Create functions " << partitionSize << std::endl;
+    cout << groupValue << endl;
+    auto partition = builder->FindPartition(partName);
+    if(partition != nullptr) {
+        std::cerr << "Partition " << partName << " already exists." << std::endl;
+        return 1;
+    }
+
+    {
+        TraceScope trace("AddPartition", partName);
+        partition = builder->AddPartition(partName, groupValue, 0);
+    }
+    cout << partition << endl;
+    if(partition == nullptr) {
+        std::cerr << "Failed to add partition" << std::endl;
+        return 1;
+    }
+    bool result = resizeWithPolicy(builder, partition, partitionSize, policy);
+    std::cout << "Growing partition " << result << std::endl;
+    if(!result) {
+        std::cerr << "Not enough space to resize partition" << std::endl;
+        return 1;
+    }
+    if(!saveToDisk(std::move(builder))) {
+        std::cerr << "Failed to write partition table" << std::endl;
+        return 1;
+    }
+    if (!isBlockDevice(superPath)) {
+        std::cout << "Not mapping " << partName << ": " << superPath << " is not a block device" << std::endl;
+        return 0;
+    }
+    string dmPath;
+    auto dmCreateRes = mapPartition(superPath, slotValue, partName, &dmPath);
+    if(!dmCreateRes) {
+        std::cerr << "Could not map partition: " << partName << std::endl;
+        return 1;
+    }
+    std::cout << "Creating dm partition for " << partName << " answered " << dmCreateRes << " at " << dmPath << std::endl;
+    return 0;
+}
+
+int removePartition(PartitionBuilder& builder, const string& superPath, const string& partName, bool discard) {
+    bool useDm = isBlockDevice(superPath);
+    if (useDm && isMapped(partName)) {
+        destroyLogicalPartition(partName);
+    }
+    std::vector<std::pair<uint64_t, uint64_t>> released;
+    if (auto partition = builder->FindPartition(partName); partition != nullptr) {
+        released = linearRegions(partition);
+    }
+    {
+        TraceScope trace("RemovePartition", partName);
+        builder->RemovePartition(partName);
+    }
+    if(!saveToDisk(std::move(builder))) {
+        std::cerr << "Failed to write partition table" << std::endl;
+        return 1;
+    }
+    cout << "Successful removal of the section: " << partName << endl;
+    if (discard) {
+        if (useDm && isMapped(partName)) {
+            std::cerr << "Not discarding " << partName << ": it is still mapped" << std::endl;
+            return 1;
+        }
+        return discardRegions(superPath, released) ? 0 : 1;
+    }
+    return 0;
+}
+
+int resizePartition(PartitionBuilder& builder, const string& superPath, int slotValue,
+                    const string& partName, uint64_t partitionSize, bool discard, AllocPolicy policy) {
+    auto partition = builder->FindPartition(partName);
+    if(partition == nullptr) {
+        std::cerr << "Partition does not exist" << std::endl;
+        return 1;
+    }
+    auto oldRegions = linearRegions(partition);
+    bool result = resizeWithPolicy(builder, partition, partitionSize, policy);
+    if(!result) {
+        std::cerr << "Not enough space to resize partition" << std::endl;
+        return 1;
+    }
+    auto metadata = exportMetadata(builder);
+    if(!metadata || !UpdateAllPartitionMetadata(superPath, *metadata.get(), slotValue)) {
+        std::cerr << "Failed to write partition table" << std::endl;
+        return 1;
+    }
+    std::cout << "Resizing partition " << result << std::endl;
+    // A mapped partition keeps its dm device; only its table is swapped.
+    std::vector<string> toMap;
+    bool reloaded = !isBlockDevice(superPath) || reloadMappedPartitions(*metadata.get(), superPath, {partName}, &toMap);
+    if (!toMap.empty()) {
+        string dmPath;
+        auto dmCreateRes = mapPartition(superPath, slotValue, partName, &dmPath);
+        if(!dmCreateRes) {
+            std::cerr << "Could not map partition: " << partName << std::endl;
+            return 1;
+        }
+        std::cout << "Creating dm partition for " << partName << " answered " << dmCreateRes << " at " << dmPath << std::endl;
+    }
+    cout << "Successful change in section for the section:" << partName << endl;
+    // Only once no dm table points at the released extents anymore.
+    auto released = subtractRegions(oldRegions, linearRegions(partition));
+    if (discard && !released.empty()) {
+        if (!reloaded) {
+            std::cerr << "Not discarding: " << partName << " is still mapped with its old size" << std::endl;
+            return 1;
+        }
+        return discardRegions(superPath, released) ? 0 : 1;
+    }
+    return 0;
+}
+
+int replacePartition(PartitionBuilder& builder, const string& groupValue, const string& suffixValue,
+                     const string& OriginalPartName, const string& NewPartName) {
+    auto OriginalPartition = builder->FindPartition(OriginalPartName);
+    if(OriginalPartition == nullptr) {
+        std::cerr << "The original section was not found, maybe you meant " << OriginalPartName << suffixValue << "?" << std::endl;
+        return 1;
+    }
+    auto NewPartition = builder->FindPartition(NewPartName);
+    std::vector<std::unique_ptr<Extent>> originalExtents;
+    const auto& extents = OriginalPartition->extents();
+    for(unsigned i=0; i<extents.size(); i++) {
+        const auto& extend = extents[i];
+        auto linear = extend->AsLinearExtent();
+        if(linear != nullptr) {
+            auto copyLinear = std::make_unique<LinearExtent>(linear->num_sectors(), linear->device_index(), linear->physical_sector());
+            originalExtents.push_back(std::move(copyLinear));
+        } else {
+            auto copyZero = std::make_unique<ZeroExtent>(extend->num_sectors());
+            originalExtents.push_back(std::move(copyZero));
+        }
+        builder->RemovePartition(OriginalPartName);
+        builder->RemovePartition(NewPartName);
+        auto NewPartition = builder->AddPartition(NewPartName, groupValue, 0);
+        if(NewPartition == nullptr) {
+            std::cerr << "Failed to add partition" << std::endl;
+            return 1;
+        }
+        for(auto&& extent: originalExtents) {
+            NewPartition->AddExtent(std::move(extent));
+        }
+        if(!saveToDisk(std::move(builder))) {
+            std::cerr << "Failed to write partition table" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int mapPartitionCommand(const string& superPath, int slotValue, const string& partName) {
+    string dmPath;
+    auto dmCreateRes = mapPartition(superPath, slotValue, partName, &dmPath);
+    if(!dmCreateRes) {
+        std::cerr << "Could not map partition: " << partName << std::endl;
+        return 1;
+    }
+    std::cout << "Creating dm partition for " << partName << " answered " << dmCreateRes << " at " << dmPath << std::endl;
+    return 0;
+}
+
+int unmapPartitionCommand(const string& partName) {
+    auto dmState = android::dm::DeviceMapper::Instance().GetState(partName);
+    if(dmState == android::dm::DmDeviceState::ACTIVE) {
+        if (!destroyLogicalPartition(partName)) {
+            std::cerr << "Unable to unmap " << partName << std::endl;
+            return 1;
+        }
+    }
+    cout << "Successful remote Mapping DM section: " << partName << endl;
+    return 0;
+}
+
+int mapPartitionsCommand(const MetadataIndex& index, const string& superPath, std::vector<string> names,
+                         bool all, const string& groupValue) {
+    if (all) {
+        for (const auto& partition : index.ListPartitionsInGroup(groupValue)) {
+            if (partition->num_extents != 0) {
+                names.push_back(GetPartitionName(*partition));
+            }
+        }
+    }
+    std::vector<MapResult> results;
+    bool ok = mapPartitions(index.metadata(), superPath, names, &results);
+    for (const auto& result : results) {
+        if (result.ok) {
+            std::cout << result.name << ":" << result.path << std::endl;
+        } else {
+            std::cerr << "Could not map partition: " << result.name << std::endl;
+        }
+    }
+    return ok ? 0 : 1;
+}
+
+int unmapPartitionsCommand(const MetadataIndex& index, std::vector<string> names, bool all,
+                           const string& groupValue) {
+    if (all) {
+        for (const auto& partition : index.ListPartitionsInGroup(groupValue)) {
+            if (isMapped(GetPartitionName(*partition))) {
+                names.push_back(GetPartitionName(*partition));
+            }
+        }
+    }
+    std::vector<bool> results;
+    bool ok = unmapPartitions(names, &results);
+    for (size_t i = 0; i < names.size(); i++) {
+        if (results[i]) {
+            std::cout << names[i] << ":unmapped" << std::endl;
+        } else {
+            std::cerr << "Unable to unmap " << names[i] << std::endl;
+        }
+    }
+    return ok ? 0 : 1;
+}
+
+int printFreeSpace(const MetadataIndex& index, const string& groupValue) {
+    auto partitions = index.ListPartitionsInGroup(groupValue);
+    for (const auto& partition : partitions) {
+        cout << "" << endl;
+        auto name = GetPartitionName(*partition);
+        auto bytesOnDisk = index.BytesOnDisk(*partition);
+        float size_mb = std::round((bytesOnDisk / 1024.0 / 1024.0) * 100) / 100.0;
+        if ( size_mb == 0 ) {
+            size_mb = std::round((bytesOnDisk / 1024.0) * 100) / 100.0;
+            std::cout << name << ":" << bytesOnDisk << ":" << size_mb << "KB" << std::endl;
+        } else {
+            std::cout << name << ":" << bytesOnDisk << ":" << size_mb << "MB" << std::endl;
+        }
+    }
+    cout << "" << endl;
+    uint64_t groupAllocatable = groupFreeSpace(index, groupValue);
+
+    printf("Free space: %" PRIu64 "\n", groupAllocatable);
+    return 0;
+}
+
+int printFreeExtents(const MetadataIndex& index) {
+    auto free = superFreeRegions(index.metadata());
+    uint64_t total = 0, largest = 0;
+    for (const auto& [start, end] : free) {
+        uint64_t size = (end - start) * LP_SECTOR_SIZE;
+        printf("Free: offset %" PRIu64 " size %" PRIu64 "\n", start * LP_SECTOR_SIZE, size);
+        total += size;
+        largest = std::max(largest, size);
+    }
+    printf("Free space: %" PRIu64 " in %zu region(s), largest %" PRIu64 "\n", total, free.size(), largest);
+    printf("Fragmentation: %.3f\n", fragmentationScore(free));
+    return 0;
+}
+
+int printGroupInfo(const MetadataIndex& index, const string& groupValue) {
+    if (index.FindGroup(groupValue) != nullptr) {
+        cout << "" << endl;
+        cout << "GroupInSuper->" << groupValue << " Usage->" << index.UsedSpace() << " TotalSpace->" << index.AllocatableSpace() << endl;
+        for (const auto& partition : index.ListPartitionsInGroup(groupValue)) {
+            cout << "NamePartInGroup->" << GetPartitionName(*partition) << " Size->" << index.BytesOnDisk(*partition) << endl;
+        }
+    }
+    return 0;
+}
+
+int setUnlimitedGroup(PartitionBuilder& builder, const string& groupValue) {
+    {
+        TraceScope trace("ChangeGroupSize", groupValue);
+        builder->ChangeGroupSize(groupValue, 0);
+    }
+    saveToDisk(std::move(builder));
+    return 0;
+}
+
+int clearCow(PartitionBuilder& builder, const string& superPath, bool discard) {
+    bool useDm = isBlockDevice(superPath);
+#ifndef LPTOOLS_STATIC
+    // Ensure this is a V AB device, and that no merging is taking place (merging? in gsi? uh)
+    auto svc1_1 = ::android::hardware::boot::V1_1::IBootControl::tryGetService();
+    if(svc1_1 == nullptr) {
+        std::cerr << "Couldn't get a bootcontrol HAL. You can clear cow only on V AB devices" << std::endl;
+        return 1;
+    }
+    auto mergeStatus = svc1_1->getSnapshotMergeStatus();
+    if(mergeStatus != ::android::hardware::boot::V1_1::MergeStatus::NONE) {
+        std::cerr << "Merge status is NOT none, meaning a merge is pending. Clearing COW isn't safe" << std::endl;
+        return 1;
+    }
+#endif
+
+    uint64_t superFreeSpace = builder->AllocatableSpace() - builder->UsedSpace();
+    std::cerr << "Super allocatable " << superFreeSpace << std::endl;
+
+    uint64_t total = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> released;
+    auto partitions = builder->ListPartitionsInGroup("cow");
+    for (const auto& partition : partitions) {
+        std::cout << "Deleting partition? " << partition->name() << std::endl;
+        if(ends_with(partition->name(), "-cow")) {
+            std::cout << "Deleting partition " << partition->name() << std::endl;
+            // A snapshot that is still in use keeps its data.
+            if (discard && (!useDm || !isMapped(partition->name()))) {
+                auto regions = linearRegions(partition);
+                released.insert(released.end(), regions.begin(), regions.end());
+            }
+            TraceScope trace("RemovePartition", partition->name());
+            builder->RemovePartition(partition->name());
+        }
+    }
+    if(!saveToDisk(std::move(builder))) {
+        std::cerr << "Failed to write partition table" << std::endl;
+        return 1;
+    }
+    if (!released.empty()) {
+        return discardRegions(superPath, released) ? 0 : 1;
+    }
+    return 0;
+}
+
+// A field of a daemon protocol message. Strings are unescaped into |text|, numbers,
+// booleans and null keep their literal text, and arrays of strings fill |items|.
+struct JsonField {
+    bool isString = false;
+    string text;
+    std::vector<string> items;
+};
+
+void skipJsonSpace(const string& line, size_t* pos) {
+    while (*pos < line.size() && isspace(static_cast<unsigned char>(line[*pos]))) {
+        (*pos)++;
+    }
+}
+
+bool parseJsonString(const string& line, size_t* pos, string* out) {
+    if (*pos >= line.size() || line[*pos] != '"') {
+        return false;
+    }
+    out->clear();
+    for ((*pos)++; *pos < line.size(); (*pos)++) {
+        char c = line[*pos];
+        if (c == '"') {
+            (*pos)++;
+            return true;
+        }
+        if (c != '\\') {
+            *out += c;
+            continue;
+        }
+        if (++(*pos) >= line.size()) {
+            return false;
+        }
+        switch (line[*pos]) {
+            case 'n': *out += '\n'; break;
+            case 't': *out += '\t'; break;
+            case 'r': *out += '\r'; break;
+            case 'b': *out += '\b'; break;
+            case 'f': *out += '\f'; break;
+            case 'u': {
+                unsigned code;
+                if (*pos + 4 >= line.size() || sscanf(line.c_str() + *pos + 1, "%4x", &code) != 1) {
+                    return false;
+                }
+                *pos += 4;
+                // UTF-8; surrogate pairs are not combined.
+                if (code < 0x80) {
+                    *out += char(code);
+                } else if (code < 0x800) {
+                    *out += char(0xc0 | (code >> 6));
+                    *out += char(0x80 | (code & 0x3f));
+                } else {
+                    *out += char(0xe0 | (code >> 12));
+                    *out += char(0x80 | ((code >> 6) & 0x3f));
+                    *out += char(0x80 | (code & 0x3f));
+                }
+                break;
+            }
+            default: *out += line[*pos]; break;
+        }
+    }
+    return false;
+}
+
+// Parses one line of the daemon protocol: a flat JSON object whose values are
+// strings, numbers, booleans, null or arrays of strings.
+bool parseJsonObject(const string& line, std::map<string, JsonField>* fields) {
+    size_t pos = 0;
+    skipJsonSpace(line, &pos);
+    if (pos >= line.size() || line[pos++] != '{') {
+        return false;
+    }
+    skipJsonSpace(line, &pos);
+    if (pos < line.size() && line[pos] == '}') {
+        return true;
+    }
+    while (true) {
+        string key;
+        skipJsonSpace(line, &pos);
+        if (!parseJsonString(line, &pos, &key)) {
+            return false;
+        }
+        skipJsonSpace(line, &pos);
+        if (pos >= line.size() || line[pos++] != ':') {
+            return false;
+        }
+        skipJsonSpace(line, &pos);
+        JsonField field;
+        if (pos < line.size() && line[pos] == '"') {
+            field.isString = true;
+            if (!parseJsonString(line, &pos, &field.text)) {
+                return false;
+            }
+        } else if (pos < line.size() && line[pos] == '[') {
+            pos++;
+            skipJsonSpace(line, &pos);
+            while (pos < line.size() && line[pos] != ']') {
+                string item;
+                if (!parseJsonString(line, &pos, &item)) {
+                    return false;
+                }
+                field.items.push_back(std::move(item));
+                skipJsonSpace(line, &pos);
+                if (pos < line.size() && line[pos] == ',') {
+                    pos++;
+                    skipJsonSpace(line, &pos);
+                }
+            }
+            if (pos++ >= line.size()) {
+                return false;
+            }
+        } else {
+            size_t end = line.find_first_of(",} \t", pos);
+            if (end == string::npos || end == pos) {
+                return false;
+            }
+            field.text = line.substr(pos, end - pos);
+            pos = end;
+        }
+        (*fields)[key] = std::move(field);
+        skipJsonSpace(line, &pos);
+        if (pos < line.size() && line[pos] == ',') {
+            pos++;
+            continue;
+        }
+        return pos < line.size() && line[pos] == '}';
+    }
+}
+
+// Points stdout and stderr at memory files while a request runs, so the commands
+// answer over the socket with the same output they print on a terminal.
+class OutputCapture {
+public:
+    OutputCapture() {
+        std::cout.flush();
+        std::cerr.flush();
+        fflush(stdout);
+        fflush(stderr);
+        for (int i = 0; i < 2; i++) {
+            files_[i].reset(syscall(__NR_memfd_create, i ? "lptools-stderr" : "lptools-stdout", MFD_CLOEXEC));
+            saved_[i].reset(dup(STDOUT_FILENO + i));
+            if (files_[i] >= 0 && saved_[i] >= 0) {
+                dup2(files_[i], STDOUT_FILENO + i);
+            }
+        }
+    }
+    ~OutputCapture() { Finish(nullptr, nullptr); }
+
+    void Finish(string* out, string* err) {
+        std::cout.flush();
+        std::cerr.flush();
+        fflush(stdout);
+        fflush(stderr);
+        string* targets[2] = {out, err};
+        for (int i = 0; i < 2; i++) {
+            if (saved_[i] >= 0) {
+                dup2(saved_[i], STDOUT_FILENO + i);
+                saved_[i].reset();
+            }
+            if (targets[i] != nullptr && files_[i] >= 0) {
+                lseek(files_[i], 0, SEEK_SET);
+                android::base::ReadFdToString(files_[i], targets[i]);
+            }
+            files_[i].reset();
+        }
+    }
+
+private:
+    android::base::unique_fd files_[2];
+    android::base::unique_fd saved_[2];
+};
+
+// The tables the daemon answers from. The builder is created on the first mutation
+// and kept until another writer changes the slot on disk.
+struct DaemonState {
+    const DaemonOptions* options;
+    std::unique_ptr<MetadataIndex> index;
+    PartitionBuilder builder;
+    string defaultGroup;
+};
+
+// Whether the primary copy of the slot on disk still has the header |index| was read
+// from. Every commit changes the header checksum, so one small read catches other
+// writers without parsing the tables again.
+bool metadataUnchanged(const MetadataIndex& index, const string& superPath, uint32_t slot) {
+    const auto& metadata = index.metadata();
+    android::base::unique_fd fd(open(superPath.c_str(), O_RDONLY | O_CLOEXEC));
+    LpMetadataHeader header;
+    uint64_t offset = LP_PARTITION_RESERVED_BYTES + 2 * LP_METADATA_GEOMETRY_SIZE +
+                      uint64_t(slot) * metadata.geometry.metadata_max_size;
+    return fd >= 0 && android::base::ReadFullyAtOffset(fd, &header, sizeof(header), offset) &&
+           memcmp(header.header_checksum, metadata.header.header_checksum, sizeof(header.header_checksum)) == 0;
+}
+
+// Rereads the slot. The builder is kept only when it is known to match the new
+// tables, which is the case right after the daemon's own commit.
+bool loadDaemonIndex(DaemonState* state, bool keepBuilder) {
+    const auto& options = *state->options;
+    auto index = std::make_unique<MetadataIndex>();
+    if (!keepBuilder) {
+        state->builder = PartitionBuilder();
+    }
+    if (!index->Load(options.superPath, options.slot)) {
+        std::cerr << "Unable to read metadata from " << options.superPath << std::endl;
+        state->index.reset();
+        state->builder = PartitionBuilder();
+        return false;
+    }
+    state->index = std::move(index);
+    state->defaultGroup = detectGroup(*state->index, options.suffix);
+    return true;
+}
+
+// Rereads the slot if another writer changed it since it was cached.
+bool refreshDaemonState(DaemonState* state) {
+    const auto& options = *state->options;
+    if (state->index && metadataUnchanged(*state->index, options.superPath, options.slot)) {
+        return true;
+    }
+    if (state->index) {
+        std::cerr << "Metadata of slot " << options.slot << " changed on disk, reloaded" << std::endl;
+    }
+    return loadDaemonIndex(state, false);
+}
+
+bool ensureDaemonBuilder(DaemonState* state) {
+    if (!state->builder.Valid()) {
+        state->builder = PartitionBuilder(state->index->metadata(), state->options->slot, state->options->superPath);
+    }
+    return state->builder.Valid();
+}
+
+struct DaemonRequest {
+    int client;
+    string id;
+    std::vector<string> args;
+    // The request as --batch operations, when it is one of the mutations that can
+    // share a commit with others.
+    std::vector<BatchOperation> operations;
+};
+
+// --create/--remove/--resize/--unlimited-group and single --map/--unmap, with at most
+// a --group, are what --batch can apply. Anything else runs on its own.
+bool toBatchOperations(const std::vector<string>& args, const string& defaultGroup, size_t sequence,
+                       std::vector<BatchOperation>* operations) {
+    string group = defaultGroup;
+    std::vector<string> command;
+    for (size_t i = 0; i < args.size(); i++) {
+        if (args[i] == "--group" && i + 1 < args.size()) {
+            group = args[++i];
+        } else {
+            command.push_back(args[i]);
+        }
+    }
+    static const std::map<string, size_t> kMergeable = {{"--create", 3}, {"--remove", 2}, {"--resize", 3},
+                                                        {"--map", 2},    {"--unmap", 2},  {"--unlimited-group", 1}};
+    auto it = command.empty() ? kMergeable.end() : kMergeable.find(command[0]);
+    if (it == kMergeable.end() || command.size() != it->second) {
+        return false;
+    }
+    uint64_t size;
+    if (command.size() == 3 && !parseSize(command[2], &size)) {
+        return false;
+    }
+    command[0].erase(0, 2);
+    if (!group.empty()) {
+        operations->push_back({sequence, {"group", group}});
+    }
+    operations->push_back({sequence, std::move(command)});
+    return true;
+}
+
+void sendDaemonResponse(int client, const string& id, int status, const string& out, const string& err,
+                        size_t batched) {
+    string response = android::base::StringPrintf("{\"id\": %s, \"status\": %d, \"batched\": %zu, ",
+                                                  id.empty() ? "null" : id.c_str(), status, batched);
+    response += "\"stdout\": " + jsonString(out) + ", \"stderr\": " + jsonString(err) + "}\n";
+    if (client >= 0 && !android::base::WriteStringToFd(response, client)) {
+        std::cerr << "Unable to answer client: " << strerror(errno) << std::endl;
+    }
+}
+
+// Commits queued mutations with one metadata write. If the combined batch fails before
+// anything was written, the requests are retried one by one so each gets its own
+// result; once the tables are written every request gets the combined result.
+void flushDaemonMutations(DaemonState* state, std::vector<DaemonRequest>* pending) {
+    if (pending->empty()) {
+        return;
+    }
+    const auto& options = *state->options;
+    auto commit = [&](const std::vector<BatchOperation>& operations, string* out, string* err,
+                      bool* committed) {
+        OutputCapture capture;
+        int status = 1;
+        *committed = false;
+        // Read requests run in between may have changed it.
+        setCommitAllSlots(options.allSlots);
+        if (refreshDaemonState(state) && ensureDaemonBuilder(state)) {
+            status = applyBatch(state->builder, operations, state->defaultGroup, options.superPath, options.slot,
+                                committed);
+            // Before the write the builder holds whatever was applied ahead of the
+            // failing operation; after it, it is exactly what was written.
+            loadDaemonIndex(state, *committed);
+        }
+        capture.Finish(out, err);
+        return status;
+    };
+    std::vector<BatchOperation> combined;
+    for (const auto& request : *pending) {
+        combined.insert(combined.end(), request.operations.begin(), request.operations.end());
+    }
+    string out, err;
+    bool committed = false;
+    if (pending->size() > 1) {
+        int status = commit(combined, &out, &err, &committed);
+        if (committed) {
+            for (const auto& request : *pending) {
+                sendDaemonResponse(request.client, request.id, status, out, err, pending->size());
+            }
+            pending->clear();
+            return;
+        }
+    }
+    for (const auto& request : *pending) {
+        int status = commit(request.operations, &out, &err, &committed);
+        sendDaemonResponse(request.client, request.id, status, out, err, 1);
+    }
+    pending->clear();
+}
+
+int openDaemonSocket(const string& socketPath) {
+    if (socketPath == kDefaultDaemonSocket) {
+        // Started by init with `socket lptools stream ...`.
+        int fd = android_get_control_socket("lptools");
+        if (fd >= 0) {
+            return fd;
+        }
+    }
+    sockaddr_un address = {};
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << socketPath << std::endl;
+        return -1;
+    }
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(socketPath.c_str());
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, 16) != 0) {
+        std::cerr << "Unable to listen on " << socketPath << ": " << strerror(errno) << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+int runDaemon(const DaemonOptions& options, const DaemonCommandRunner& runCommand) {
+    android::base::unique_fd listenFd(openDaemonSocket(options.socketPath));
+    if (listenFd < 0) {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    DaemonState state = {&options, nullptr, PartitionBuilder(), ""};
+    if (!refreshDaemonState(&state)) {
+        return 1;
+    }
+    std::cout << "Serving " << options.superPath << " slot " << options.slot << " on " << options.socketPath
+              << std::endl;
+
+    std::map<int, string> clients;  // fd -> unterminated input
+    std::vector<DaemonRequest> pending;
+    std::chrono::steady_clock::time_point commitAt;
+    size_t sequence = 0;
+    auto closeClient = [&](int fd) {
+        close(fd);
+        clients.erase(fd);
+        for (auto& request : pending) {
+            if (request.client == fd) {
+                request.client = -1;
+            }
+        }
+    };
+    auto handleLine = [&](int fd, const string& line) {
+        std::map<string, JsonField> fields;
+        if (!parseJsonObject(line, &fields) || fields["args"].items.empty()) {
+            sendDaemonResponse(fd, "", 1, "", "Expected {\"id\": ..., \"args\": [\"--command\", ...]}\n", 0);
+            return;
+        }
+        // The id is echoed back as is, so only strings and plain numbers are accepted.
+        const auto& idField = fields["id"];
+        string id = idField.isString ? jsonString(idField.text) : idField.text;
+        if (!idField.isString && idField.text.find_first_not_of("0123456789-") != string::npos) {
+            id.clear();
+        }
+        DaemonRequest request = {fd, id, std::move(fields["args"].items), {}};
+        const auto& args = request.args;
+        if (std::find(args.begin(), args.end(), "--daemon") != args.end() ||
+            std::find(args.begin(), args.end(), "--client") != args.end() ||
+            std::find(args.begin(), args.end(), "-") != args.end()) {
+            sendDaemonResponse(fd, request.id, 1, "", "Not supported by the daemon\n", 0);
+            return;
+        }
+        if (toBatchOperations(args, state.defaultGroup, ++sequence, &request.operations)) {
+            if (pending.empty()) {
+                commitAt = std::chrono::steady_clock::now() + options.commitDelay;
+            }
+            pending.push_back(std::move(request));
+            return;
+        }
+        // Anything else sees the queued mutations first.
+        flushDaemonMutations(&state, &pending);
+        string out, err;
+        int status;
+        {
+            OutputCapture capture;
+            status = refreshDaemonState(&state) ? runCommand(args, state.index.get()) : 1;
+            capture.Finish(&out, &err);
+        }
+        sendDaemonResponse(fd, request.id, status, out, err, 1);
+    };
+
+    while (true) {
+        std::vector<pollfd> fds = {{listenFd.get(), POLLIN, 0}};
+        for (const auto& [fd, input] : clients) {
+            fds.push_back({fd, POLLIN, 0});
+        }
+        int timeout = -1;
+        if (!pending.empty()) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(commitAt - std::chrono::steady_clock::now());
+            timeout = std::max<int>(0, left.count());
+        }
+        if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+            std::cerr << "poll failed: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        for (const auto& entry : fds) {
+            if (entry.revents == 0) {
+                continue;
+            }
+            if (entry.fd == listenFd.get()) {
+                int client = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (client >= 0) {
+                    clients.emplace(client, "");
+                }
+                continue;
+            }
+            char buffer[4096];
+            ssize_t n = TEMP_FAILURE_RETRY(read(entry.fd, buffer, sizeof(buffer)));
+            if (n <= 0) {
+                closeClient(entry.fd);
+                continue;
+            }
+            auto& input = clients[entry.fd];
+            input.append(buffer, n);
+            for (size_t newline; (newline = input.find('\n')) != string::npos;) {
+                string line = input.substr(0, newline);
+                input.erase(0, newline + 1);
+                handleLine(entry.fd, line);
+            }
+        }
+        if (!pending.empty() && std::chrono::steady_clock::now() >= commitAt) {
+            flushDaemonMutations(&state, &pending);
+        }
+    }
+}
+
+int runClient(const string& socketPath, const std::vector<string>& args) {
+    sockaddr_un address = {};
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << socketPath << std::endl;
+        return 1;
+    }
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath.c_str());
+    android::base::unique_fd fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cerr << "Unable to connect to " << socketPath << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    string request = "{\"id\": 1, \"args\": [";
+    for (size_t i = 0; i < args.size(); i++) {
+        request += (i ? ", " : "") + jsonString(args[i]);
+    }
+    request += "]}\n";
+    if (!android::base::WriteStringToFd(request, fd)) {
+        std::cerr << "Unable to send request: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    string response;
+    char buffer[4096];
+    while (response.find('\n') == string::npos) {
+        ssize_t n = TEMP_FAILURE_RETRY(read(fd, buffer, sizeof(buffer)));
+        if (n <= 0) {
+            std::cerr << "The daemon closed the connection" << std::endl;
+            return 1;
+        }
+        response.append(buffer, n);
+    }
+    std::map<string, JsonField> fields;
+    if (!parseJsonObject(response.substr(0, response.find('\n')), &fields)) {
+        std::cerr << "Malformed response: " << response;
+        return 1;
+    }
+    std::cout << fields["stdout"].text;
+    std::cerr << fields["stderr"].text;
+    return atoi(fields["status"].text.c_str());
+}